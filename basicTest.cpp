@@ -6,9 +6,239 @@
 #include <sys/types.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <signal.h>
+#include <set>
+#include <ctype.h>
 
 using namespace std;
 
+// number of failed checks.
+int failures = 0;
+
+// a method to print a check and count it if it failed.
+void check(bool ok, const char* what){
+	printf ("%s - %s\n", ok ? "OK" : "FAILED", what);
+	if (!ok){
+		printf ("The error message is: %s.\n", pft_get_error().c_str());
+		++failures;
+	}
+}
+
+// a method to build a "cat" command, which answers every input with itself.
+pft_cmd_struct catCmd(char delim, pft_framing framing){
+	pft_cmd_struct cmd;
+	cmd.path = "/bin/cat";
+	cmd.argv.push_back("cat");
+	cmd.in_delim = delim;
+	cmd.framing = framing;
+	return cmd;
+}
+
+// a method to build a command answering every input with itself, which sleeps on "slow" -
+// only the first time any child gets it, if once is set.
+pft_cmd_struct slowCmd(bool once){
+	pft_cmd_struct cmd;
+	cmd.path = "/bin/sh";
+	cmd.argv.push_back("sh");
+	cmd.argv.push_back("-c");
+	cmd.argv.push_back(once ?
+		"while read x; do if [ \"$x\" = slow ] && mkdir /tmp/pft_basic_test_slow 2>/dev/null; then sleep 3; fi; echo \"$x\"; done" :
+		"while read x; do if [ \"$x\" = slow ]; then sleep 3; fi; echo \"$x\"; done");
+	cmd.in_delim = '\n';
+	cmd.framing = PFT_FRAME_NEWLINE;
+	return cmd;
+}
+
+// a method to run slowCmd with the given timeouts, checking that the call is fast, and that only
+// "slow" is given up - or not even it, if only its first try is slow.
+void checkSlow(int file_ms, int chunk_ms, bool speculate, bool once, const char* what){
+	pft_timeouts_struct timeouts = {file_ms, chunk_ms, speculate};
+	vector<string> inputs, results;
+	for (int i=0; i<30; ++i){
+		inputs.push_back(i == 12 ? "slow" : "fast " + to_string(i));
+	}
+	rmdir("/tmp/pft_basic_test_slow");
+	timeval start, end;
+	gettimeofday(&start, NULL);
+	bool ok = pft_set_timeouts(&timeouts) == SUCCESS && pft_run(slowCmd(once), inputs, results) == SUCCESS;
+	gettimeofday(&end, NULL);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	for (int i=0; ok && i<30; ++i){
+		ok = results[i] == (i == 12 && !once ? string(PFT_TIMED_OUT) : inputs[i]);
+	}
+	printf ("took %f seconds\n", secs);
+	check(ok && secs < 2.5, what);
+}
+
+// a method to read a whole file into a string.
+string readFile(const char* path){
+	string content;
+	FILE* file = fopen(path, "rb");
+	char buf[4096];
+	size_t len;
+	while (file && (len = fread(buf, 1, sizeof(buf), file)) > 0){
+		content.append(buf, len);
+	}
+	if (file){
+		fclose(file);
+	}
+	return content;
+}
+
+// a method to write a string over a whole file.
+void writeFile(const char* path, const string& content){
+	FILE* file = fopen(path, "wb");
+	fwrite(content.data(), 1, content.size(), file);
+	fclose(file);
+}
+
+// a method to find the children of process parent named comm (only zombies, if asked).
+vector<pid_t> findChildren(pid_t parent, const char* comm, bool zombies){
+	vector<pid_t> found;
+	DIR* proc = opendir("/proc");
+	dirent* entry;
+	while (proc && (entry = readdir(proc)) != NULL){
+		string stat = readFile(("/proc/" + string(entry->d_name) + "/stat").c_str());
+		size_t open = stat.find('('), close = stat.rfind(')');
+		if (open == string::npos || close == string::npos || close + 4 >= stat.size()){
+			continue;
+		}
+		char state = stat[close + 2];
+		if (atoi(stat.c_str() + close + 4) == parent && stat.substr(open + 1, close - open - 1) == comm &&
+			(!zombies || state == 'Z')){
+			found.push_back(atoi(entry->d_name));
+		}
+	}
+	if (proc){
+		closedir(proc);
+	}
+	return found;
+}
+
+// a method to skip the JSON value at pos in json, returns false if it is not valid.
+bool skipJson(const string& json, size_t& pos){
+	while (pos < json.size() && isspace((unsigned char) json[pos])){
+		++pos;
+	}
+	if (pos >= json.size()){
+		return false;
+	}
+	char c = json[pos];
+	if (c == '{' || c == '['){
+		char close = (c == '{') ? '}' : ']';
+		++pos;
+		bool first = true;
+		while (true){
+			while (pos < json.size() && isspace((unsigned char) json[pos])){
+				++pos;
+			}
+			if (pos < json.size() && json[pos] == close){
+				++pos;
+				return true;
+			}
+			if (!first){
+				if (pos >= json.size() || json[pos] != ','){
+					return false;
+				}
+				++pos;
+			}
+			first = false;
+			if (c == '{'){
+				while (pos < json.size() && isspace((unsigned char) json[pos])){
+					++pos;
+				}
+				if (pos >= json.size() || json[pos] != '"' || !skipJson(json, pos)){
+					return false;
+				}
+				while (pos < json.size() && isspace((unsigned char) json[pos])){
+					++pos;
+				}
+				if (pos >= json.size() || json[pos] != ':'){
+					return false;
+				}
+				++pos;
+			}
+			if (!skipJson(json, pos)){
+				return false;
+			}
+		}
+	}
+	if (c == '"'){
+		for (++pos; pos < json.size() && json[pos] != '"'; ++pos){
+			if (json[pos] == '\\'){
+				++pos;
+			}
+		}
+		return pos++ < json.size();
+	}
+	size_t start = pos;
+	while (pos < json.size() && (isalnum((unsigned char) json[pos]) || strchr("+-.", json[pos]))){
+		++pos;
+	}
+	string word = json.substr(start, pos - start);
+	return word == "true" || word == "false" || word == "null" ||
+		   (!word.empty() && strspn(word.c_str(), "0123456789+-.eE") == word.size());
+}
+
+// a method to check that json holds a single valid JSON value.
+bool validJson(const string& json){
+	size_t pos = 0;
+	if (!skipJson(json, pos)){
+		return false;
+	}
+	while (pos < json.size() && isspace((unsigned char) json[pos])){
+		++pos;
+	}
+	return pos == json.size();
+}
+
+// a method to count the occurrences of part in str.
+int countOf(const string& str, const string& part){
+	int count = 0;
+	for (size_t pos = str.find(part); pos != string::npos; pos = str.find(part, pos + 1)){
+		++count;
+	}
+	return count;
+}
+
+// SIGPIPE signals that reached this process (the host of the library).
+volatile sig_atomic_t sigpipes = 0;
+
+// a SIGPIPE handler, counting them.
+void countSigpipe(int sig){
+	++sigpipes;
+}
+
+// a method to append a string to a file.
+void appendFile(const char* path, const string& content){
+	FILE* file = fopen(path, "ab");
+	fwrite(content.data(), 1, content.size(), file);
+	fclose(file);
+}
+
+// the changes pft_watch passed to watchCallback, the types it got, and how many batches held path.
+set<string> watch_changed, watch_removed;
+map<string, string> watch_types;
+int watch_batches_with_path = 0;
+
+// a callback for pft_watch, collecting every delta. arg is a path whose batches are counted.
+int watchCallback(const pft_delta_struct& delta, void* arg){
+	bool has_path = false;
+	for (int i=0; i<(int) delta.changed.size(); ++i){
+		watch_changed.insert(delta.changed[i]);
+		watch_types[delta.changed[i]] = delta.types[i];
+		has_path = has_path || delta.changed[i] == (const char*) arg;
+	}
+	watch_removed.insert(delta.removed.begin(), delta.removed.end());
+	if (has_path){
+		++watch_batches_with_path;
+	}
+	return 0;
+}
+
 // a method to print a vector.
 void printVec(vector<string> vec){
 	printf ("start to print the vector:\n");
@@ -27,6 +257,7 @@ int main( int argc, const char* argv[] ){
 
 	string files[] = {"/bin/ls", "/etc/fstab", "/usr/bin/file"};
 	vector<string> in, out;
+	vector<string> files_vec(files, files + 3);
 	pft_stats_struct stat;
 
 
@@ -40,6 +271,12 @@ int main( int argc, const char* argv[] ){
 	printf ("\nI make an init with ParallelismLevel=1\n");
 	pft_init(1);
 
+	printf ("\nI dump the trace before it was ever started.\n");
+	const char* trace_path = "/tmp/pft_basic_test_trace.json";
+	string trace;
+	check(pft_trace_dump(trace_path) == SUCCESS && validJson(trace = readFile(trace_path)) &&
+		  trace.find("\"traceEvents\":[\n]") != string::npos, "empty trace");
+
 
 
 	printf ("\nI am printing empty statistics\n");
@@ -73,12 +310,359 @@ int main( int argc, const char* argv[] ){
 
 	printf ("\nI print the types vector received from pft_find_types. \n");
 	printVec(out);
+
+	printf ("\nI run cat instead of file, with newline, NUL and length framing.\n");
+	vector<string> lines, results;
+	for (int i=0; i<100; ++i){
+		lines.push_back("line " + to_string(i));
+	}
+	check(pft_run(catCmd('\n', PFT_FRAME_NEWLINE), lines, results) == SUCCESS && results == lines,
+		  "newline framing");
+	check(pft_run(catCmd('\0', PFT_FRAME_NUL), lines, results) == SUCCESS && results == lines,
+		  "NUL framing");
+	// every input carries its own length, which covers the delimiter cat echoes after it
+	vector<string> records, expected;
+	for (int i=0; i<100; ++i){
+		string payload = lines[i] + "\nwith a newline\n";
+		uint32_t len = payload.size();
+		records.push_back(string((const char*) &len, sizeof(len)) + payload.substr(0, len - 1));
+		expected.push_back(payload);
+	}
+	check(pft_run(catCmd('\n', PFT_FRAME_LENGTH), records, results) == SUCCESS && results == expected,
+		  "length framing");
+
+	printf ("\nI run a command that does not exist, then file again.\n");
+	pft_cmd_struct bad = catCmd('\n', PFT_FRAME_NEWLINE);
+	bad.path = "/no/such/tool";
+	check(pft_run(bad, lines, results) == FAILURE, "bad command fails");
+	out.clear();
+	check(pft_find_types(in, out) == SUCCESS && out.size() == in.size(), "file works after a bad command");
+
+	printf ("\nI run an executable that can not be executed (exec fails in the children), then file again.\n");
+	const char* not_program = "/tmp/pft_basic_test_not_a_program";
+	FILE* not_program_file = fopen(not_program, "w");
+	fprintf(not_program_file, "not a program\n");
+	fclose(not_program_file);
+	chmod(not_program, 0755);
+	bad.path = not_program;
+	check(pft_run(bad, lines, results) == FAILURE, "failed exec fails");
+	out.clear();
+	check(pft_find_types(in, out) == SUCCESS && out.size() == in.size(), "file works after a failed exec");
+	unlink(not_program);
+
+	printf ("\nI run a command whose child exits on one input, then the same command again.\n");
+	pft_cmd_struct dying;
+	dying.path = "/bin/sh";
+	dying.argv.push_back("sh");
+	dying.argv.push_back("-c");
+	dying.argv.push_back("while read x; do [ \"$x\" = die ] && exit 3; echo \"$x\"; done");
+	dying.in_delim = '\n';
+	dying.framing = PFT_FRAME_NEWLINE;
+	vector<string> with_die, without_die, dying_results;
+	with_die.push_back("a");
+	with_die.push_back("die");
+	with_die.push_back("b");
+	with_die.push_back("c");
+	check(pft_run(dying, with_die, dying_results) == FAILURE, "dying child fails the call");
+	for (int i=0; i<20; ++i){
+		without_die.push_back("line " + to_string(i));
+	}
+	check(pft_run(dying, without_die, dying_results) == SUCCESS && dying_results == without_die,
+		  "same command works after a child died");
+
+	printf ("\nI write to children which closed their input, with my own SIGPIPE handler.\n");
+	struct sigaction pipe_action, current_action;
+	memset(&pipe_action, 0, sizeof(pipe_action));
+	pipe_action.sa_handler = countSigpipe;
+	sigemptyset(&pipe_action.sa_mask);
+	sigaction(SIGPIPE, &pipe_action, NULL);
+	pft_cmd_struct closing;
+	closing.path = "/bin/sh";
+	closing.argv.push_back("sh");
+	closing.argv.push_back("-c");
+	closing.argv.push_back("read x; echo \"$x\"; exec 0<&-; sleep 2");
+	closing.in_delim = '\n';
+	closing.framing = PFT_FRAME_NEWLINE;
+	vector<string> one_each(3, "x"), closing_results;
+	check(pft_run(closing, one_each, closing_results) == SUCCESS && closing_results == one_each,
+		  "every child answers once, then closes its input");
+	usleep(200000);
+	check(pft_run(closing, one_each, closing_results) == FAILURE &&
+		  pft_get_error().find("write") != string::npos, "writing to them fails");
+	sigset_t pending_signals;
+	sigpending(&pending_signals);
+	sigaction(SIGPIPE, NULL, &current_action);
+	check(sigpipes == 0 && !sigismember(&pending_signals, SIGPIPE) && current_action.sa_handler == countSigpipe,
+		  "no SIGPIPE reached the host, and its handler is kept");
+	signal(SIGPIPE, SIG_DFL);
+
+	printf ("\nI run a command that sleeps 3 seconds on one input, which should be given up sooner,\n");
+	printf ("or answered by a speculative copy if it is only slow once.\n");
+	checkSlow(200, 0, false, false, "file timeout alone");
+	checkSlow(0, 0, true, true, "speculation alone");
+	checkSlow(1000, 0, true, false, "file timeout with speculation");
+	rmdir("/tmp/pft_basic_test_slow");
+
+	printf ("\nI speculate with cat, where nothing is slow, so no child should be replaced.\n");
+	pft_timeouts_struct speculate_only = {0, 0, true};
+	vector<string> spec_lines, spec_results;
+	for (int i=0; i<1000; ++i){
+		spec_lines.push_back("line " + to_string(i));
+	}
+	check(pft_set_timeouts(&speculate_only) == SUCCESS &&
+		  pft_run(catCmd('\n', PFT_FRAME_NEWLINE), spec_lines, spec_results) == SUCCESS &&
+		  spec_results == spec_lines, "speculated run");
+	vector<pid_t> cats = findChildren(getpid(), "cat", false);
+	for (int i=0; i<3; ++i){
+		check(pft_run(catCmd('\n', PFT_FRAME_NEWLINE), spec_lines, spec_results) == SUCCESS &&
+			  spec_results == spec_lines, "speculated run again, with results left from the last one");
+	}
+	check(cats.size() == 3 && findChildren(getpid(), "cat", false) == cats, "same children after speculating");
+	pft_timeouts_struct no_timeouts = {0, 0, false};
+	pft_set_timeouts(&no_timeouts);
+
+	printf ("\nI write NDJSON and binary files with cat.\n");
+	const char* out_path = "/tmp/pft_basic_test.out";
+	vector<string> odd;
+	odd.push_back("caf\xc3\xa9");
+	odd.push_back("bad \xff byte");
+	odd.push_back("\"quoted\"\tand\\");
+	check(pft_run_to_file(catCmd('\n', PFT_FRAME_NEWLINE), odd, out_path, PFT_SINK_NDJSON) == SUCCESS,
+		  "NDJSON written");
+	// in completion order, so compare every line regardless of order
+	string ndjson = readFile(out_path);
+	check(ndjson.size() > 0 && ndjson[ndjson.size() - 1] == '\n' &&
+		  ndjson.find("{\"index\":0,\"path\":\"caf\xc3\xa9\",\"result\":\"caf\xc3\xa9\"}\n") != string::npos &&
+		  ndjson.find("{\"index\":1,\"path\":\"bad \\udcff byte\",\"result\":\"bad \\udcff byte\"}\n") != string::npos &&
+		  ndjson.find("{\"index\":2,\"path\":\"\\\"quoted\\\"\\u0009and\\\\\",\"result\":\"\\\"quoted\\\"\\u0009and\\\\\"}\n") != string::npos,
+		  "NDJSON escapes quotes, control characters and invalid UTF-8");
+	check(pft_run_to_file(catCmd('\n', PFT_FRAME_NEWLINE), lines, out_path, PFT_SINK_BINARY) == SUCCESS,
+		  "binary written");
+	string binary = readFile(out_path);
+	vector<string> paths(lines.size()), types(lines.size());
+	size_t pos = sizeof(PFT_BINARY_MAGIC);
+	bool valid = binary.compare(0, pos, PFT_BINARY_MAGIC, pos) == 0;
+	while (valid && pos + sizeof(pft_record_header) <= binary.size()){
+		pft_record_header header;
+		memcpy(&header, binary.data() + pos, sizeof(header));
+		pos += sizeof(header);
+		valid = header.index < lines.size() && pos + header.path_len + header.result_len <= binary.size();
+		if (valid){
+			paths[header.index] = binary.substr(pos, header.path_len);
+			types[header.index] = binary.substr(pos + header.path_len, header.result_len);
+			pos += header.path_len + header.result_len;
+		}
+	}
+	check(valid && pos == binary.size() && paths == lines && types == lines, "binary records read back");
+	unlink(out_path);
+
+	printf ("\nI write an index file with cat and look paths up in it.\n");
+	const char* index_path = "/tmp/pft_basic_test.idx";
+	check(pft_run_to_file(catCmd('\n', PFT_FRAME_NEWLINE), lines, index_path, PFT_SINK_INDEX) == SUCCESS,
+		  "index written");
+	bool found_all = true;
+	for (int i=0; i<100; ++i){
+		string result;
+		found_all = found_all && pft_index_lookup(index_path, lines[i], result) == SUCCESS && result == lines[i];
+	}
+	check(found_all, "every path found in the index");
+	string result;
+	check(pft_index_lookup(index_path, "line 100", result) == FAILURE, "missing path not found");
+	// point the first entry of the offsets table past the end of the file
+	string index = readFile(index_path);
+	pft_index_footer footer;
+	memcpy(&footer, index.data() + index.size() - sizeof(footer), sizeof(footer));
+	uint64_t bad_offset = index.size();
+	index.replace(footer.table_offset, sizeof(bad_offset), (const char*) &bad_offset, sizeof(bad_offset));
+	writeFile(index_path, index);
+	// "line 0" sorts first, so looking it up reads the damaged entry
+	check(pft_index_lookup(index_path, "line 0", result) == FAILURE &&
+		  pft_get_error().find("Invalid index") != string::npos, "damaged index rejected");
+	vector<string> no_lines;
+	check(pft_run_to_file(catCmd('\n', PFT_FRAME_NEWLINE), no_lines, index_path, PFT_SINK_INDEX) == SUCCESS &&
+		  pft_index_lookup(index_path, lines[0], result) == FAILURE, "nothing found in an empty index");
+	unlink(index_path);
+
+	printf ("\nI take the inputs from list files and buffers instead of vectors.\n");
+	const char* list_path = "/tmp/pft_basic_test.list";
+	vector<string> list_types;
+	writeFile(list_path, "/bin/ls\n/etc/fstab\n/usr/bin/file\n");
+	check(pft_find_types(files_vec, out) == SUCCESS && pft_find_types_file(list_path, '\n', list_types) == SUCCESS &&
+		  list_types == out, "types of a newline delimited list");
+	writeFile(list_path, string("/bin/ls\0/etc/fstab\0/usr/bin/file", 32));
+	check(pft_find_types_file(list_path, '\0', list_types) == SUCCESS && list_types == out,
+		  "types of a NUL delimited list, last name unterminated");
+	vector<string> list_records, record_results;
+	list_records.push_back("a");
+	list_records.push_back("b c");
+	list_records.push_back("d");
+	writeFile(list_path, string("a\0b c\0d", 7));
+	check(pft_run_file(catCmd('\n', PFT_FRAME_NEWLINE), list_path, '\0', record_results) == SUCCESS &&
+		  record_results == list_records, "run on a NUL delimited list, last record unterminated");
+	const char* buf = "a\nb c\nd\n";
+	check(pft_run_buf(catCmd('\n', PFT_FRAME_NEWLINE), buf, strlen(buf), '\n', record_results) == SUCCESS &&
+		  record_results == list_records, "run on a buffer");
+	check(pft_run_buf(catCmd('\n', PFT_FRAME_NEWLINE), buf, strlen(buf) - 1, '\n', record_results) == SUCCESS &&
+		  record_results == list_records, "run on a buffer, last record unterminated");
+	// more than a chunk for every child, so the list is dispatched before it is all counted
+	string long_list;
+	for (int i=0; i<1000; ++i){
+		long_list += "line " + to_string(i) + "\n";
+	}
+	writeFile(list_path, long_list);
+	bool in_order = pft_run_file(catCmd('\n', PFT_FRAME_NEWLINE), list_path, '\n', record_results) == SUCCESS &&
+		record_results.size() == 1000;
+	for (int i=0; in_order && i<1000; ++i){
+		in_order = record_results[i] == "line " + to_string(i);
+	}
+	check(in_order, "long list results in input order");
+	writeFile(list_path, "");
+	check(pft_find_types_file(list_path, '\n', list_types) == SUCCESS && list_types.empty() &&
+		  pft_run_file(catCmd('\n', PFT_FRAME_NEWLINE), list_path, '\n', record_results) == SUCCESS &&
+		  record_results.empty(), "empty list");
+	unlink(list_path);
+
+	printf ("\nI trace runs and dump the traces.\n");
+	check(pft_trace_start(0) == FAILURE, "trace capacity must be positive");
+	check(pft_trace_start(100000) == SUCCESS && setParallelismLevel(3) == SUCCESS &&
+		  pft_run(catCmd('\0', PFT_FRAME_NUL), list_records, record_results) == SUCCESS &&
+		  pft_trace_dump(trace_path) == SUCCESS, "traced run");
+	trace = readFile(trace_path);
+	check(validJson(trace), "trace is valid JSON");
+	check(trace.find("\"name\":\"spawn\"") != string::npos && trace.find("\"name\":\"dispatch\"") != string::npos &&
+		  countOf(trace, "\"name\":\"result\"") == (int) list_records.size(), "trace has spawn, dispatch and result events");
+	check(pft_trace_start(5) == SUCCESS &&
+		  pft_run(catCmd('\n', PFT_FRAME_NEWLINE), spec_lines, spec_results) == SUCCESS &&
+		  pft_trace_dump(trace_path) == SUCCESS && validJson(trace = readFile(trace_path)) &&
+		  countOf(trace, "\"name\":") == 5, "wrapped trace keeps only its capacity");
+	pft_trace_stop();
+	unlink(trace_path);
+
+	printf ("\nI run pft_worker instead of file, on names file escapes.\n");
+	vector<string> names, file_types, worker_types;
+	names.push_back("/tmp/pft_basic_test_t\tab");
+	names.push_back("/tmp/pft_basic_test_\xc3\xbcn\xc3\xaf");
+	names.push_back("/tmp/pft_basic_test_bad\xff");
+	for (int i=0; i<(int) names.size(); ++i){
+		writeFile(names[i].c_str(), "#!/bin/sh\n");
+	}
+	names.push_back("/tmp/pft_basic_test_missing");
+	check(pft_find_types(names, file_types) == SUCCESS, "file on odd names");
+	check(pft_set_worker("./pft_worker") == SUCCESS && pft_find_types(names, worker_types) == SUCCESS &&
+		  worker_types == file_types, "pft_worker results the same as file");
+	for (int i=0; i<(int) names.size(); ++i){
+		unlink(names[i].c_str());
+	}
+	// names larger than the shared rings are streamed through them
+	vector<string> long_names;
+	long_names.push_back("/tmp/" + string(3 << 20, 'a'));
+	long_names.push_back("/bin/ls");
+	check(pft_find_types(long_names, worker_types) == SUCCESS && worker_types.size() == 2 &&
+		  worker_types[0].compare(0, long_names[0].size() + 2, long_names[0] + ": ") == 0 &&
+		  worker_types[1].compare(0, 9, "/bin/ls: ") == 0, "pft_worker with names larger than its ring");
+
+	printf ("\nI kill a pft_worker in the middle of a call.\n");
+	vector<string> many_names, many_types;
+	for (int i=0; i<5000; ++i){
+		many_names.push_back(i % 2 ? "/bin/ls" : "/tmp");
+	}
+	pid_t killer = fork();
+	if (killer == 0){
+		usleep(100000);
+		vector<pid_t> workers = findChildren(getppid(), "pft_worker", false);
+		_exit(workers.empty() || kill(workers[0], SIGSEGV) < 0 ? 1 : 0);
+	}
+	check(pft_find_types(many_names, many_types) == SUCCESS && many_types.size() == many_names.size(),
+		  "call with a killed worker succeeds");
+	int killer_status = 0;
+	waitpid(killer, &killer_status, 0);
+	int crashed = 0;
+	bool typed = true;
+	for (int i=0; i<(int) many_types.size(); ++i){
+		if (many_types[i] == PFT_WORKER_CRASHED){
+			++crashed;
+		}
+		else if (many_types[i].compare(0, many_names[i].size() + 2, many_names[i] + ": ") != 0){
+			typed = false;
+		}
+	}
+	check(WIFEXITED(killer_status) && WEXITSTATUS(killer_status) == 0 && crashed <= 1 && typed,
+		  "only the killed worker's file is given up");
+	check(findChildren(getpid(), "pft_worker", true).empty(), "killed worker reaped");
+
+	printf ("\nI set programs that are not workers as the worker, then pft_worker again.\n");
+	check(pft_set_worker("/bin/true") == SUCCESS && pft_find_types(in, out) == FAILURE, "exiting worker fails");
+	check(pft_set_worker("/bin/cat") == SUCCESS && pft_find_types(in, out) == FAILURE &&
+		  pft_get_error().find("did not start") != string::npos, "silent worker fails");
+	check(pft_find_types(in, out) == FAILURE, "silent worker fails again");
+	check(pft_set_worker("./pft_worker") == SUCCESS && pft_find_types(in, out) == SUCCESS &&
+		  out.size() == in.size(), "pft_worker works after them");
+	pft_set_worker(NULL);
+
+	printf ("\nI watch a tree while files and directories in it change, until it is deleted.\n");
+	const char* watch_root = "/tmp/pft_basic_test_watch";
+	const char* moved_old = "/tmp/pft_basic_test_watch_old";
+	string root_str = watch_root;
+	unlink((string(moved_old) + "/x").c_str());
+	rmdir(moved_old);
+	mkdir(watch_root, 0755);
+	mkdir((root_str + "/old").c_str(), 0755);
+	writeFile((root_str + "/old/x").c_str(), "old file\n");
+	map<string, string> watch_index;
+	vector<string> old_names, old_types;
+	old_names.push_back(root_str + "/old/x");
+	check(pft_find_types(old_names, old_types) == SUCCESS, "initial index");
+	watch_index[old_names[0]] = old_types[0];
+	string trickle = root_str + "/t";
+	pid_t changer = fork();
+	if (changer == 0){
+		usleep(300000);
+		writeFile((root_str + "/a").c_str(), "hello\n");
+		usleep(400000);
+		appendFile((root_str + "/a").c_str(), "world\n");
+		usleep(400000);
+		unlink((root_str + "/a").c_str());
+		usleep(400000);
+		mkdir((root_str + "/new").c_str(), 0755);
+		writeFile((root_str + "/new/f").c_str(), "#!/bin/sh\n");
+		usleep(400000);
+		// appended every 50ms for 1.2 seconds, never quiet for the 100ms debounce
+		for (int i=0; i<24; ++i){
+			appendFile(trickle.c_str(), "x");
+			usleep(50000);
+		}
+		usleep(400000);
+		rename((root_str + "/old").c_str(), moved_old);
+		usleep(400000);
+		unlink((root_str + "/new/f").c_str());
+		rmdir((root_str + "/new").c_str());
+		unlink(trickle.c_str());
+		rmdir(watch_root);
+		_exit(0);
+	}
+	vector<string> watch_roots;
+	watch_roots.push_back(root_str + "/");
+	check(pft_watch(watch_roots, watch_index, 100, watchCallback, (void*) trickle.c_str()) == FAILURE &&
+		  pft_get_error().find("deleted or moved") != string::npos, "watch fails once its root is deleted");
+	waitpid(changer, NULL, 0);
+	check(watch_changed.count(root_str + "/a") && watch_removed.count(root_str + "/a"),
+		  "created, modified and deleted file");
+	check(watch_changed.count(root_str + "/new/f") &&
+		  watch_types[root_str + "/new/f"].find("shell script") != string::npos, "file in a new directory");
+	check(watch_batches_with_path >= 2, "file changed more often than the debounce is still handed out");
+	check(watch_removed.count(root_str + "/old/x") && watch_removed.count(root_str + "/new/f") &&
+		  watch_removed.count(trickle), "moved away and deleted directories drop their files");
+	check(watch_index.empty(), "nothing left in the index of a deleted root");
+	unlink((string(moved_old) + "/x").c_str());
+	rmdir(moved_old);
+
 	printf ("I call pft_done. \n");
 	pft_done();
 	printf ("--------------Test ends-----------------\n");
+	printf ("%d checks failed.\n", failures);
 
 
-	return 0;
+	return failures == 0 ? 0 : 1;
 }
 
 
@@ -9,15 +9,38 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
 #include <string>
 #include <algorithm>
 #include <unistd.h>
 #include <limits.h>
 #include <iostream>
 #include <queue>
+#include <deque>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <exception>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "pft.h"
+#include "pft_ring.h"
+
+#ifdef PFT_USDT
+#include <sys/sdt.h>
+#endif
 
 // Parallelism level
 static int para_level;
@@ -32,12 +55,36 @@ static const char* FILE_CMD = "file";
 static const char* FILE_FLAG_FLUSH = "-n";
 static const char* FILE_FLAG_STDIN = "-f-";
 
+// pft_worker command, used instead of 'file' once set
+static std::string worker_path = "";
+static const char* WORKER_CMD = "pft_worker";
+static const char* WORKER_CHANNEL_NAME = "pft_channel";
+// Time a new worker has to write PFT_WORKER_HELLO into its channel
+static const int WORKER_HANDSHAKE_MS = 2000;
+
+// Command the children currently run
+static pft_cmd_struct cur_cmd;
+static bool cur_cmd_inited = false;
+
 // Function names
 static const std::string FUNC_INIT = "pft_init";
 static const std::string FUNC_GET_STATS = "pft_get_stats";
 static const std::string FUNC_FIND_TYPES = "pft_find_types";
+static const std::string FUNC_RUN = "pft_run";
+static const std::string FUNC_RUN_BUF = "pft_run_buf";
+static const std::string FUNC_RUN_FILE = "pft_run_file";
+static const std::string FUNC_FIND_TYPES_FILE = "pft_find_types_file";
 static const std::string FUNC_SET_PARA = "setParallelismLevel";
 static const std::string FUNC_DONE = "pft_done";
+static const std::string FUNC_SET_TIMEOUTS = "pft_set_timeouts";
+static const std::string FUNC_TRACE_START = "pft_trace_start";
+static const std::string FUNC_TRACE_DUMP = "pft_trace_dump";
+static const std::string FUNC_WATCH = "pft_watch";
+static const std::string FUNC_SET_WORKER = "pft_set_worker";
+static const std::string FUNC_RUN_TO_FILE = "pft_run_to_file";
+static const std::string FUNC_FIND_TYPES_TO_FILE = "pft_find_types_to_file";
+static const std::string FUNC_FIND_TYPES_FILE_TO_FILE = "pft_find_types_file_to_file";
+static const std::string FUNC_INDEX_LOOKUP = "pft_index_lookup";
 
 // Error strings
 static const std::string ERROR_STR = " error: ";
@@ -50,17 +97,161 @@ static const std::string ERROR_N_PARA = "Invalid parallelism level";
 static const std::string ERROR_NULLPTR = "Null pointer exception";
 static const std::string ERROR_READ = "Pipe read error";
 static const std::string ERROR_WRITE = "Pipe write error";
+static const std::string ERROR_CMD = "Invalid command";
+static const std::string ERROR_TIMEOUT = "Invalid timeout";
+static const std::string ERROR_OPEN = "Error opening the file list";
+static const std::string ERROR_MMAP = "Error mapping the file list";
+static const std::string ERROR_TRACE_SIZE = "Invalid trace capacity";
+static const std::string ERROR_TRACE_OFF = "Tracing was compiled out";
+static const std::string ERROR_TRACE_FILE = "Error writing the trace file";
+static const std::string ERROR_WATCH = "Error watching a directory";
+static const std::string ERROR_EVENTS = "Error reading file events";
+static const std::string ERROR_ROOT_GONE = "A watched root was deleted or moved";
+static const std::string ERROR_DEBOUNCE = "Invalid debounce time";
+static const std::string ERROR_WORKER = "Worker is not an executable";
+static const std::string ERROR_HANDSHAKE = "Worker did not start as a pft_worker";
+static const std::string ERROR_CHANNEL = "Error creating a shared memory channel";
+static const std::string ERROR_SINK_OPEN = "Error opening the output file";
+static const std::string ERROR_SINK_WRITE = "Error writing the output file";
+static const std::string ERROR_SINK_FORMAT = "Invalid output format";
+static const std::string ERROR_INDEX = "Invalid index file";
+static const std::string ERROR_NOT_FOUND = "Path not in index";
 
 // Delimiters
 static const char NEWLINE = '\n';
+static const char SLASH = '/';
+static const char NUL = '\0';
 
 // Return values
 static const int CODE_SUCCESS = 0;
 static const int CODE_FAIL = -1;
 
+/**
+ * A file sent to a child - its index, and its name which points into the run's inputs.
+ */
+struct FileSlot
+{
+	int file;
+	const char* name;
+	size_t len;
+};
+
+/**
+ * The inputs of a run, read one after the other - either the strings of a vector, or the
+ * delimited records of a buffer (e.g a mapped file list) which are never copied on their own.
+ */
+class InputSource
+{
+public:
+	/**
+	 * Inputs are the strings of vec.
+	 */
+	InputSource(const std::vector<std::string>& vec) :
+		_vec(&vec), _buf(nullptr), _len(0), _delim(NEWLINE), _pos(0), _count(vec.size())
+	{
+	}
+
+	/**
+	 * Inputs are the records of buf, each ended by delim. The last one may be unterminated.
+	 * They are not counted in advance - buf is only read once, as the inputs are taken.
+	 */
+	InputSource(const char* buf, size_t len, char delim) :
+		_vec(nullptr), _buf(buf), _len(len), _delim(delim), _pos(0), _count(-1)
+	{
+	}
+
+	/**
+	 * Returns the number of inputs, or -1 if they are not known before they are all taken.
+	 */
+	int size() const
+	{
+		return _count;
+	}
+
+	/**
+	 * Returns true if all the inputs were taken.
+	 */
+	bool empty() const
+	{
+		return _vec ? _pos >= _vec->size() : _pos >= _len;
+	}
+
+	/**
+	 * Returns the number of inputs not taken yet, counting at most max of them.
+	 */
+	int countUpTo(int max) const
+	{
+		if (_vec)
+		{
+			return std::min<size_t>(max, _vec->size() - _pos);
+		}
+		int count = 0;
+		for (const char* p = _buf + _pos; p < _buf + _len && count < max; ++count)
+		{
+			const char* end = (const char*) memchr(p, _delim, _buf + _len - p);
+			p = end ? end + 1 : _buf + _len;
+		}
+		return count;
+	}
+
+	/**
+	 * Points name at the next input and sets len to its length.
+	 * Returns false if there are no more inputs.
+	 */
+	bool next(const char*& name, size_t& len)
+	{
+		if (_vec)
+		{
+			if (_pos >= _vec->size())
+			{
+				return false;
+			}
+			name = (*_vec)[_pos].data();
+			len = (*_vec)[_pos].size();
+			++_pos;
+			return true;
+		}
+		if (_pos >= _len)
+		{
+			return false;
+		}
+		name = _buf + _pos;
+		const char* end = (const char*) memchr(name, _delim, _len - _pos);
+		len = end ? end - name : _len - _pos;
+		_pos += len + 1;
+		return true;
+	}
+
+private:
+	const std::vector<std::string>* _vec;
+	const char* _buf;
+	size_t _len;
+	char _delim;
+	size_t _pos;
+	int _count;
+};
+
 // Process chuck size
 const int DEFAULT_CHUNK_SIZE = 50;
 
+// File events watched by pft_watch
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE |
+								   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+								   IN_ONLYDIR;
+static const int EVENTS_BUF_SIZE = 64 * 1024;
+// Longest pft_watch holds a change back, in debounce times, however often events keep coming
+static const int WATCH_MAX_DEBOUNCES = 4;
+
+// Output files - writes are handed to a background thread in batches of SINK_BATCH_SIZE bytes,
+// at most SINK_MAX_BATCHES of them waiting at once
+static const size_t SINK_BATCH_SIZE = 1024 * 1024;
+static const size_t SINK_MAX_BATCHES = 4;
+static const mode_t SINK_FILE_MODE = 0644;
+
+// Timeouts and speculation, all disabled by default
+static pft_timeouts_struct timeouts = {0, 0, false};
+static const double MS_IN_SEC = 1000.0;
+
 
 // Parent <-> Children communication pipes
 int** outPipes = nullptr; // Parent writes to children
@@ -68,12 +259,100 @@ int** inPipes = nullptr; // Parent reads from children
 
 // Children handling
 std::vector<pid_t> children;
-static bool childrenAlive = true;
+static volatile sig_atomic_t childrenAlive = true;
+
+// Parent <-> pft_worker shared memory channels, used instead of the pipes when the children
+// are workers. The pipes then only carry doorbells.
+static bool ring_transport = false;
+static std::vector<pft_channel*> channels;
+static std::vector<int> channel_fds;
+// Names written to each worker but not yet into its requests ring, which was full
+static std::vector<std::string> unsent;
+
+// Files a child was still working on when the last call ended (a speculated file another
+// child answered first), and the output it already wrote for them. Their results are
+// dropped at the start of the next call.
+static std::vector<int> stale_results;
+static std::vector<std::string> stale_pending;
 
 // Stats
 int statFileNum;
 double statTime;
 
+// Trace event types, and their names in the exported trace
+enum TraceType
+{
+	TRACE_SPAWN,     // child forked, arg is its pid
+	TRACE_RESPAWN,   // child killed to be replaced, arg is its pid
+	TRACE_DISPATCH,  // chunk written to child, arg is its number of files
+	TRACE_SPECULATE, // copy of a straggler's files written to child, arg is their number
+	TRACE_SELECT,    // span of a select() call, arg is the number of ready children
+	TRACE_READ,      // span of a read from child, arg is the number of bytes now unparsed
+	TRACE_PARSE,     // span of cutting results out of a read, arg is the number of results
+	TRACE_RESULT,    // result received from child, arg is the file index
+	TRACE_TIMEOUT    // child timed out, arg is the index of the file it was stuck on
+};
+static const char* TRACE_NAMES[] = {"spawn", "respawn", "dispatch", "speculate", "select",
+									"read", "parse", "result", "timeout"};
+
+// A trace event - an instant, or a span if dur_us is positive. child is -1 for the parent.
+struct TraceEvent
+{
+	uint64_t ts_us;
+	uint64_t dur_us;
+	int type;
+	int child;
+	long arg;
+};
+
+// Trace ring buffer. Only the parent process writes to it, so it needs no locking.
+static std::vector<TraceEvent> trace_buf;
+static uint64_t trace_count = 0;
+static bool trace_on = false;
+
+#ifndef PFT_NO_TRACE
+#define PFT_TRACE(type, child, arg) \
+	do { if (trace_on) traceEvent(type, child, arg, 0); } while (0)
+#define PFT_TRACE_BEGIN(start) \
+	uint64_t start = trace_on ? traceNow() : 0
+#define PFT_TRACE_END(type, child, arg, start) \
+	do { if (trace_on) traceEvent(type, child, arg, start); } while (0)
+#else
+#define PFT_TRACE(type, child, arg)
+#define PFT_TRACE_BEGIN(start)
+#define PFT_TRACE_END(type, child, arg, start)
+#endif
+
+
+/**
+ * Returns a monotonic timestamp in microseconds.
+ */
+uint64_t traceNow()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Records a trace event, overwriting the oldest one if the buffer is full.
+ * If start is 0 the event is an instant, otherwise a span from start until now.
+ */
+void traceEvent(int type, int child, long arg, uint64_t start)
+{
+	uint64_t now = traceNow();
+	TraceEvent& event = trace_buf[trace_count % trace_buf.size()];
+	event.ts_us = start ? start : now;
+	event.dur_us = start ? now - start : 0;
+	event.type = type;
+	event.child = child;
+	event.arg = arg;
+	++trace_count;
+#ifdef PFT_USDT
+	DTRACE_PROBE3(pft, event, type, child, arg);
+#endif
+}
+
 
 
 /**
@@ -118,6 +397,55 @@ void setError(const std::string& func_name, const std::string& error)
 	last_error = func_name + ERROR_STR + error;
 }
 
+/**
+ * Opens the reading and writing pipes of child #childNum.
+ * The pipes are close-on-exec, so no child keeps another child's pipe ends open (which would
+ * hide its EOF when it dies). The child's own ends survive the exec through dup2.
+ */
+void openChildPipes(int childNum)
+{
+	if ( pipe2(inPipes[childNum], O_CLOEXEC) < 0 || pipe2(outPipes[childNum], O_CLOEXEC) < 0)
+	{
+		throw ERROR_PIPE;
+	}
+	if (!ring_transport)
+	{
+		return;
+	}
+
+	// The channel's fd is kept until the child is forked, the mapping until it is killed
+	int fd = memfd_create(WORKER_CHANNEL_NAME, MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, sizeof(pft_channel)) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		throw ERROR_CHANNEL;
+	}
+	void* map = mmap(NULL, sizeof(pft_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		throw ERROR_CHANNEL;
+	}
+	channels[childNum] = (pft_channel*) map;
+	channel_fds[childNum] = fd;
+}
+
+/**
+ * Unmaps the shared memory channel of child #childNum, if it has one.
+ */
+void closeChannel(int childNum)
+{
+	if (ring_transport && channels[childNum])
+	{
+		munmap(channels[childNum], sizeof(pft_channel));
+		channels[childNum] = nullptr;
+		unsent[childNum].clear();
+	}
+}
+
 /**
  * Creates para_level pipes for reading and para_level pipes for writing.
  * Saved into inPipes and outPipes respectively.
@@ -150,10 +478,7 @@ int createPipes()
 		}
 
 		// pipe error
-		if ( pipe(inPipes[child]) < 0 || pipe(outPipes[child]) < 0)
-		{
-			throw ERROR_PIPE;
-		}
+		openChildPipes(child);
 	}
 	pipes_inited = true;
 	return CODE_SUCCESS;
@@ -174,65 +499,250 @@ int killChildren()
 			}
 			delete[] inPipes[child];
 			delete[] outPipes[child];
-			waitpid(children[child], NULL, 0);
+			if (children[child] > 0)
+			{
+				// A child left with stale work may be stuck on it - do not wait for it to finish
+				if (child < (int) stale_results.size() && stale_results[child] > 0)
+				{
+					kill(children[child], SIGKILL);
+				}
+				waitpid(children[child], NULL, 0);
+			}
+			closeChannel(child);
 		}
 		delete[] inPipes;
 		delete[] outPipes;
 	}
+	children.clear();
+	stale_results.clear();
+	stale_pending.clear();
 	pipes_inited = false;
 	return CODE_SUCCESS;
 }
 
 /**
- * Creates all the child processes and pipes
+ * Kills all the child processes right away, whatever they are doing, so the next call spawns
+ * new ones. Used after a failed call, so nothing is reported.
  */
-int spawnChildren()
+void resetPool()
 {
-	createPipes();
-	for(int child = 0; child < para_level; ++child)
+	for (size_t child = 0; child < children.size(); ++child)
+	{
+		if (children[child] > 0)
+		{
+			kill(children[child], SIGKILL);
+		}
+	}
+	try
+	{
+		killChildren();
+	}
+	catch (const std::string& str)
+	{
+		children.clear();
+		pipes_inited = false;
+	}
+}
+
+/**
+ * Returns the 'file' command, flushing after every result and reading file names from stdin.
+ */
+pft_cmd_struct fileCmd()
+{
+	pft_cmd_struct cmd;
+	cmd.path = FILE_CMD_PATH;
+	cmd.argv.push_back(FILE_CMD);
+	cmd.argv.push_back(FILE_FLAG_FLUSH);
+	cmd.argv.push_back(FILE_FLAG_STDIN);
+	cmd.in_delim = NEWLINE;
+	cmd.framing = PFT_FRAME_NEWLINE;
+	return cmd;
+}
+
+/**
+ * Returns the pft_worker command set by pft_set_worker. Its results are length prefixed.
+ */
+pft_cmd_struct workerCmd()
+{
+	pft_cmd_struct cmd;
+	cmd.path = worker_path;
+	cmd.argv.push_back(WORKER_CMD);
+	cmd.in_delim = NEWLINE;
+	cmd.framing = PFT_FRAME_LENGTH;
+	return cmd;
+}
+
+/**
+ * Returns the command calculating file types - pft_worker if one was set, 'file' otherwise.
+ */
+pft_cmd_struct typesCmd()
+{
+	return worker_path.empty() ? fileCmd() : workerCmd();
+}
+
+/**
+ * Returns true if cmd is the pft_worker set by pft_set_worker, talking through shared memory.
+ */
+bool isWorker(const pft_cmd_struct& cmd)
+{
+	return !worker_path.empty() && cmd.path == worker_path;
+}
+
+/**
+ * Returns the command the children run, 'file' unless pft_run was given another one.
+ */
+const pft_cmd_struct& currentCmd()
+{
+	if (!cur_cmd_inited)
+	{
+		cur_cmd = fileCmd();
+		cur_cmd_inited = true;
+	}
+	return cur_cmd;
+}
+
+/**
+ * Returns true if the two commands execute the same program with the same arguments,
+ * i.e running one of them does not require respawning the children of the other.
+ */
+bool sameProgram(const pft_cmd_struct& a, const pft_cmd_struct& b)
+{
+	return a.path == b.path && a.argv == b.argv;
+}
+
+/**
+ * Waits for the new worker #childNum to ring for the first time, and checks it wrote
+ * PFT_WORKER_HELLO into its channel before. Kills it if it did not.
+ */
+void checkHandshake(int childNum)
+{
+	struct pollfd poll_fd = {FDReadFromChild(childNum), POLLIN, 0};
+	int ready;
+	while ((ready = poll(&poll_fd, 1, WORKER_HANDSHAKE_MS)) < 0 && errno == EINTR)
+	{
+	}
+	char bell;
+	if (ready <= 0 || read(FDReadFromChild(childNum), &bell, 1) != 1 ||
+		channels[childNum]->hello.load() != PFT_WORKER_HELLO)
+	{
+		kill(children[childNum], SIGKILL);
+		throw ERROR_HANDSHAKE;
+	}
+}
+
+/**
+ * Forks child #childNum, whose pipes are already open, and executes the current command in it.
+ * A pft_worker child must also complete the handshake.
+ */
+void spawnChild(int childNum)
+{
+	// Build the exec arguments before forking
+	const pft_cmd_struct& cmd = currentCmd();
+	std::vector<char*> args;
+	for (size_t i = 0; i < cmd.argv.size(); ++i)
+	{
+		args.push_back(const_cast<char*>(cmd.argv[i].c_str()));
+	}
+	args.push_back(NULL);
+
+	pid_t pid = fork();
+
+	if(pid < 0)
 	{
-		pid_t pid = fork();
+		throw ERROR_FORK;
+	}
 
-		if(pid < 0)
+	else if (pid == 0)
+	{
+		if(dup2(FDReadFromParent(childNum), STDIN_FILENO) < 0 ||
+		   dup2(FDWriteToParent(childNum), STDOUT_FILENO) < 0)
 		{
-			throw ERROR_FORK;
+			kill(getppid(), SIGUSR1);
 		}
 
-		else if (pid == 0)
+		for (int i = 0; i < para_level; ++i)
 		{
-			if(dup2(FDReadFromParent(child), STDIN_FILENO) < 0 ||
-			   dup2(FDWriteToParent(child), STDOUT_FILENO) < 0)
+			if (close(FDReadFromChild(i)) < 0 || close(FDWriteToChild(i)) < 0 )
 			{
 				kill(getppid(), SIGUSR1);
 			}
+		}
 
-			for (int i = 0; i < para_level; ++i)
-			{
-				if (close(FDReadFromChild(i)) < 0 || close(FDWriteToChild(i)) < 0 )
-				{
-					kill(getppid(), SIGUSR1);
-				}
-			}
+		// The worker finds its channel at a known fd, which must survive the exec
+		if (ring_transport &&
+			(dup2(channel_fds[childNum], PFT_RING_FD) < 0 || fcntl(PFT_RING_FD, F_SETFD, 0) < 0))
+		{
+			kill(getppid(), SIGUSR1);
+		}
 
-			int res = execl(FILE_CMD_PATH, FILE_CMD, FILE_FLAG_FLUSH, FILE_FLAG_STDIN, NULL);
-			if(res < 0)
-			{
-				kill(getppid(), SIGUSR1);
-			}
+		int res = execv(cmd.path.c_str(), args.data());
+		if(res < 0)
+		{
+			kill(getppid(), SIGUSR1);
+			_exit(CODE_FAIL);
 		}
+	}
 
-		else
+	else
+	{
+		children[childNum] = pid;
+		PFT_TRACE(TRACE_SPAWN, childNum, pid);
+		if(close(FDWriteToParent(childNum)) < 0 || close(FDReadFromParent(childNum)) < 0)
 		{
-			children.push_back(pid);
-			if(close(FDWriteToParent(child)) < 0 || close(FDReadFromParent(child)) < 0)
-			{
-				throw ERROR_CLOSE;
-			}
+			throw ERROR_CLOSE;
 		}
+		if (ring_transport && close(channel_fds[childNum]) < 0)
+		{
+			throw ERROR_CLOSE;
+		}
+		if (ring_transport)
+		{
+			checkHandshake(childNum);
+		}
+	}
+}
+
+/**
+ * Creates all the child processes and pipes
+ */
+int spawnChildren()
+{
+	// A failure of earlier children (e.g a bad command) says nothing about the new ones
+	childrenAlive = true;
+	ring_transport = isWorker(currentCmd());
+	channels.assign(para_level, nullptr);
+	channel_fds.assign(para_level, -1);
+	unsent.assign(para_level, std::string());
+	stale_results.assign(para_level, 0);
+	stale_pending.assign(para_level, std::string());
+	createPipes();
+	children.assign(para_level, 0);
+	for(int child = 0; child < para_level; ++child)
+	{
+		spawnChild(child);
 	}
 	return CODE_SUCCESS;
 }
 
+/**
+ * Kills child #childNum, which may be stuck on some file, and replaces it with a fresh one.
+ */
+void respawnChild(int childNum)
+{
+	PFT_TRACE(TRACE_RESPAWN, childNum, children[childNum]);
+	kill(children[childNum], SIGKILL);
+	if (close(FDReadFromChild(childNum)) < 0 || close(FDWriteToChild(childNum)) < 0)
+	{
+		throw ERROR_CLOSE;
+	}
+	waitpid(children[childNum], NULL, 0);
+	closeChannel(childNum);
+	stale_results[childNum] = 0;
+	stale_pending[childNum].clear();
+	openChildPipes(childNum);
+	spawnChild(childNum);
+}
+
 /**
  * Error handler for child untimely death
  * @param sig the singal number
@@ -252,6 +762,7 @@ void setSignalHandler()
 {
 	struct sigaction psa;
 	psa.sa_handler = &childErrorHandler;
+	sigemptyset(&psa.sa_mask);
 	psa.sa_flags = SA_NOCLDSTOP;
 	sigaction(SIGUSR1, &psa, NULL);
 }
@@ -298,7 +809,7 @@ int pft_done()
 	{
 		return killChildren();
 	}
-	catch (const char* str)
+	catch (const std::string& str)
 	{
 		setError(FUNC_DONE, str);
 		return CODE_FAIL;
@@ -329,13 +840,13 @@ int setParallelismLevel(int n)
 		para_level = n;
 		spawnChildren();
 	}
-	catch (char const* str)
+	catch (const std::string& str)
 	{
 		try
 		{
 			killChildren();
 		}
-		catch (char const* str)
+		catch (const std::string& str)
 		{
 			setError(FUNC_SET_PARA, str);
 			return CODE_FAIL;
@@ -400,225 +911,1976 @@ void pft_clear_stats()
 }
 
 /**
- * Returns an fd_set of the reading-from-children file descriptor
+ * Sets the per-file and per-chunk timeouts, and whether straggling chunks are speculatively
+ * re-executed once there is no new work.
+ * Fails if timeouts is null or any of the timeouts is negative.
  */
-fd_set getReadFDs()
+int pft_set_timeouts(const pft_timeouts_struct* new_timeouts)
 {
-	fd_set reads;
-	FD_ZERO(&reads);
-	for(int child = 0; child < para_level; child++)
+	if (!new_timeouts)
 	{
-		// Add parent read+write ends to sets
-		FD_SET(FDReadFromChild(child), &reads);
+		setError(FUNC_SET_TIMEOUTS, ERROR_NULLPTR);
+		return CODE_FAIL;
 	}
-	return reads;
+	if (new_timeouts->file_ms < 0 || new_timeouts->chunk_ms < 0)
+	{
+		setError(FUNC_SET_TIMEOUTS, ERROR_TIMEOUT);
+		return CODE_FAIL;
+	}
+	timeouts = *new_timeouts;
+	return CODE_SUCCESS;
 }
 
 /**
- * Reads PIPE_BUF bytes from the given child and returns the string.
+ * Makes pft_find_types (and the functions built on it) run the pft_worker executable at path
+ * instead of 'file', exchanging names and results with it through shared memory.
+ * A null path goes back to 'file'. The children are respawned on the next call, which fails
+ * if they do not complete the handshake (see checkHandshake).
+ * Fails if path is not an executable.
  */
-std::string readAllFromChild(int child)
+int pft_set_worker(const char* path)
 {
-	int fd = FDReadFromChild(child);
-	char temp_buff[PIPE_BUF] = "";
-	if (read(fd, temp_buff, PIPE_BUF) <= 0)
+	if (path && access(path, X_OK) < 0)
 	{
-		throw ERROR_READ;
+		setError(FUNC_SET_WORKER, ERROR_WORKER);
+		return CODE_FAIL;
 	}
-	std::string str = std::string(temp_buff);
-	return str;
+	worker_path = path ? path : "";
+	return CODE_SUCCESS;
 }
 
 /**
- * Writes the string str to given child.
- * Returns number of bytes written.
+ * Starts recording trace events into a buffer of the given capacity, dropping any earlier ones.
+ * Once the buffer is full the oldest events are overwritten.
+ * Fails if capacity is not positive, or if tracing was compiled out (PFT_NO_TRACE).
  */
-int writeToChild(int child, std::string str)
+int pft_trace_start(int capacity)
 {
-	int write_fd = FDWriteToChild(child);
-	int written = write(write_fd, str.c_str(), str.size());
-	if (written < 0)
+#ifdef PFT_NO_TRACE
+	setError(FUNC_TRACE_START, ERROR_TRACE_OFF);
+	return CODE_FAIL;
+#else
+	if (capacity <= 0)
 	{
-		throw ERROR_WRITE;
+		setError(FUNC_TRACE_START, ERROR_TRACE_SIZE);
+		return CODE_FAIL;
 	}
-	return written;
+	try
+	{
+		trace_buf.assign(capacity, TraceEvent());
+	}
+	catch (const std::bad_alloc&)
+	{
+		setError(FUNC_TRACE_START, ERROR_BAD_ALLOC);
+		return CODE_FAIL;
+	}
+	trace_count = 0;
+	trace_on = true;
+	return CODE_SUCCESS;
+#endif
 }
 
 /**
- * Returns the maximal FD in the given set.
- * @return
+ * Stops recording trace events. The recorded events are kept until the next pft_trace_start.
+ * The function must not fail.
  */
-int getMaxFD()
+void pft_trace_stop()
 {
-	int max_fd = 0;
-	for(int child = 0; child < para_level; child++)
+	trace_on = false;
+}
+
+/**
+ * Writes the recorded trace events, oldest first, to the file at path in Chrome trace JSON format.
+ * Every child gets its own lane (tid child + 1), the parent's own events are on lane 0.
+ * Fails if path is null or the file can not be written.
+ */
+int pft_trace_dump(const char* path)
+{
+	if (!path)
 	{
-		int child_fd = FDReadFromChild(child);
-		if (child_fd > max_fd)
+		setError(FUNC_TRACE_DUMP, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	FILE* out = fopen(path, "w");
+	if (!out)
+	{
+		setError(FUNC_TRACE_DUMP, ERROR_TRACE_FILE);
+		return CODE_FAIL;
+	}
+
+	uint64_t kept = std::min<uint64_t>(trace_count, trace_buf.size());
+	int pid = getpid();
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (uint64_t i = trace_count - kept; i < trace_count; ++i)
+	{
+		const TraceEvent& event = trace_buf[i % trace_buf.size()];
+		fprintf(out, "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,", TRACE_NAMES[event.type],
+				event.dur_us ? "X" : "i", (unsigned long long) event.ts_us);
+		if (event.dur_us)
 		{
-			max_fd = child_fd;
+			fprintf(out, "\"dur\":%llu,", (unsigned long long) event.dur_us);
+		}
+		else
+		{
+			fprintf(out, "\"s\":\"t\",");
 		}
+		fprintf(out, "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}}%s\n", pid, event.child + 1,
+				event.arg, (i + 1 < trace_count) ? "," : "");
 	}
-	return max_fd;
-}
+	fprintf(out, "],\"displayTimeUnit\":\"ms\"}\n");
 
+	if (fclose(out) != 0)
+	{
+		setError(FUNC_TRACE_DUMP, ERROR_TRACE_FILE);
+		return CODE_FAIL;
+	}
+	return CODE_SUCCESS;
+}
 
 /**
- * Calculates the time difference between two given timevals.
+ * Returns an fd_set of the reading-from-children file descriptor
+ */
+fd_set getReadFDs()
+{
+	fd_set reads;
+	FD_ZERO(&reads);
+	for(int child = 0; child < para_level; child++)
+	{
+		// Add parent read+write ends to sets
+		FD_SET(FDReadFromChild(child), &reads);
+	}
+	return reads;
+}
+
+/**
+ * Writes len bytes of buf to the pipe fd of a child, like write().
+ * SIGPIPE is blocked around the write, so a child that died makes it fail with EPIPE instead of
+ * killing the calling process, and the SIGPIPE it raised is consumed before the mask is restored.
+ * The host's own SIGPIPE handling is left as it is.
+ */
+ssize_t writeToPipe(int fd, const void* buf, size_t len)
+{
+	sigset_t pipe_set;
+	sigset_t old_set;
+	sigset_t pending_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	// A SIGPIPE that was already pending belongs to someone else - leave it
+	sigpending(&pending_set);
+	bool was_pending = sigismember(&pending_set, SIGPIPE);
+	ssize_t written = write(fd, buf, len);
+	if (written < 0 && errno == EPIPE && !was_pending)
+	{
+		int write_errno = errno;
+		timespec no_wait = {0, 0};
+		while (sigtimedwait(&pipe_set, NULL, &no_wait) < 0 && errno == EINTR)
+		{
+		}
+		errno = write_errno;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return written;
+}
+
+/**
+ * Writes a doorbell to worker #child.
+ * A worker which died (EPIPE) is not an error here - its EOF is handled by the read loop.
+ */
+void ringWorker(int child)
+{
+	if (writeToPipe(FDWriteToChild(child), &PFT_DOORBELL, 1) < 0 && errno != EPIPE)
+	{
+		throw ERROR_WRITE;
+	}
+}
+
+/**
+ * Writes as much of the names waiting for the requests ring of worker #child as fits, and
+ * rings it. If some are still left, asks the worker to ring back once it frees space.
+ */
+void flushToWorker(int child)
+{
+	pft_channel* channel = channels[child];
+	bool was_empty;
+	uint64_t written = 0;
+	while (written < unsent[child].size())
+	{
+		uint64_t now_written = pft_ring_write_some(&channel->requests, unsent[child].data() + written,
+												   unsent[child].size() - written, was_empty);
+		if (now_written > 0)
+		{
+			written += now_written;
+			continue;
+		}
+		if (channel->parent_waiting.load())
+		{
+			break;
+		}
+		// Full - ask for a doorbell, then try once more in case the worker read meanwhile
+		channel->parent_waiting.store(1);
+	}
+	if (written == unsent[child].size())
+	{
+		channel->parent_waiting.store(0);
+	}
+	unsent[child].erase(0, written);
+	if (written > 0)
+	{
+		ringWorker(child);
+	}
+}
+
+/**
+ * Reads PIPE_BUF bytes from the given child and returns the string.
+ * With pft_worker children the pipe only holds doorbells, and the string is everything
+ * waiting in the child's results ring. Names still waiting for the requests ring are written.
+ * A pft_worker which died sets closed, after the results it left in the ring are returned.
+ */
+std::string readAllFromChild(int child, bool& closed)
+{
+	int fd = FDReadFromChild(child);
+	char temp_buff[PIPE_BUF];
+	int bytes_read = read(fd, temp_buff, PIPE_BUF);
+	closed = bytes_read <= 0;
+	if (closed && !ring_transport)
+	{
+		throw ERROR_READ;
+	}
+	if (!ring_transport)
+	{
+		return std::string(temp_buff, bytes_read);
+	}
+
+	// Drain until empty - the worker checks tail after moving head, so no result is missed
+	std::string str;
+	uint64_t ring_read;
+	while ((ring_read = pft_ring_read(&channels[child]->results, temp_buff, PIPE_BUF)) > 0)
+	{
+		str.append(temp_buff, ring_read);
+	}
+	if (closed)
+	{
+		return str;
+	}
+	if (channels[child]->worker_waiting.load())
+	{
+		ringWorker(child);
+	}
+	if (!unsent[child].empty())
+	{
+		flushToWorker(child);
+	}
+	return str;
+}
+
+/**
+ * Writes the string str to given child.
+ * With pft_worker children str goes to the child's requests ring, followed by a doorbell.
+ * What does not fit is written as the worker frees space (see flushToWorker).
+ * Returns number of bytes written.
+ */
+int writeToChild(int child, std::string str)
+{
+	int write_fd = FDWriteToChild(child);
+	if (ring_transport)
+	{
+		unsent[child] += str;
+		flushToWorker(child);
+		return str.size();
+	}
+	int written = writeToPipe(write_fd, str.c_str(), str.size());
+	if (written < 0)
+	{
+		throw ERROR_WRITE;
+	}
+	return written;
+}
+
+/**
+ * Returns the maximal FD in the given set.
+ * @return
+ */
+int getMaxFD()
+{
+	int max_fd = 0;
+	for(int child = 0; child < para_level; child++)
+	{
+		int child_fd = FDReadFromChild(child);
+		if (child_fd > max_fd)
+		{
+			max_fd = child_fd;
+		}
+	}
+	return max_fd;
+}
+
+
+/**
+ * Calculates the time difference between two given timevals.
+ */
+double calcTimeDiff(const timeval* t1, const timeval* t2)
+{
+	timeval res;
+	timersub(t2, t1, &res);
+	return res.tv_sec + res.tv_usec / 1000000.0;
+}
+
+/**
+ * Cuts the next complete result, starting at pos in buf, according to the given framing.
+ * On success the result is put into record and pos is advanced past it.
+ * Returns false if buf does not hold a complete result yet.
+ */
+bool nextRecord(pft_framing framing, const std::string& buf, size_t& pos, std::string& record)
+{
+	if (framing == PFT_FRAME_LENGTH)
+	{
+		uint32_t len;
+		if (buf.size() - pos < sizeof(len))
+		{
+			return false;
+		}
+		memcpy(&len, buf.data() + pos, sizeof(len));
+		if (buf.size() - pos - sizeof(len) < len)
+		{
+			return false;
+		}
+		record.assign(buf, pos + sizeof(len), len);
+		pos += sizeof(len) + len;
+		return true;
+	}
+
+	char delim = (framing == PFT_FRAME_NUL) ? NUL : NEWLINE;
+	size_t end = buf.find(delim, pos);
+	if (end == std::string::npos)
+	{
+		return false;
+	}
+	record.assign(buf, pos, end - pos);
+	pos = end + 1;
+	return true;
+}
+
+/**
+ * Returns true if the result of the file in slot was already received, or is not wanted
+ * (a file of the last call, which has a negative index).
+ */
+bool isDone(const FileSlot& slot, const std::vector<bool>& done)
+{
+	return slot.file < 0 || done[slot.file];
+}
+
+/**
+ * Returns true if the results of all the files in queue were already received.
+ */
+bool allDone(const std::deque<FileSlot>& queue, const std::vector<bool>& done)
+{
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		if (!isDone(queue[i], done))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Returns the busy child which made no progress for the longest time, whose work was not
+ * duplicated yet and still has files without a result, or -1 if there is none.
+ */
+int findStraggler(const std::vector< std::deque<FileSlot> >& positions,
+				  const std::vector<bool>& duplicated, const std::vector<timeval>& last_result,
+				  const std::vector<bool>& done)
+{
+	int straggler = -1;
+	for (int child = 0; child < para_level; ++child)
+	{
+		if (positions[child].empty() || duplicated[child] || allDone(positions[child], done))
+		{
+			continue;
+		}
+		if (straggler < 0 || timercmp(&last_result[child], &last_result[straggler], <))
+		{
+			straggler = child;
+		}
+	}
+	return straggler;
+}
+
+/**
+ * Returns the seconds left until a busy child, which got its chunk at chunk_start and last
+ * returned a result at last_result, times out. Returns a negative number if no timeout is set.
+ */
+double timeLeft(const timeval& chunk_start, const timeval& last_result, const timeval* now)
+{
+	if (timeouts.file_ms == 0 && timeouts.chunk_ms == 0)
+	{
+		return -1;
+	}
+	double left = -1;
+	if (timeouts.file_ms > 0)
+	{
+		left = timeouts.file_ms / MS_IN_SEC - calcTimeDiff(&last_result, now);
+	}
+	if (timeouts.chunk_ms > 0)
+	{
+		double chunk_left = timeouts.chunk_ms / MS_IN_SEC - calcTimeDiff(&chunk_start, now);
+		left = (timeouts.file_ms > 0) ? std::min(left, chunk_left) : chunk_left;
+	}
+	return std::max(0.0, left);
+}
+
+/**
+ * Returns true if a busy child, which got its chunk at chunk_start and last returned a result
+ * at last_result, exceeded one of the timeouts.
+ */
+bool timedOut(const timeval& chunk_start, const timeval& last_result, const timeval* now)
+{
+	if (timeouts.file_ms == 0 && timeouts.chunk_ms == 0)
+	{
+		return false;
+	}
+	return timeLeft(chunk_start, last_result, now) <= 0;
+}
+
+/**
+ * Sets wait to the time until the first busy child times out and returns it, or returns NULL
+ * if no busy child can (select should wait forever).
+ */
+timeval* nextTimeout(const std::vector< std::deque<FileSlot> >& positions,
+					 const std::vector<timeval>& chunk_start, const std::vector<timeval>& last_result,
+					 const timeval* now, timeval* wait)
+{
+	double min_left = -1;
+	for (int child = 0; child < para_level; ++child)
+	{
+		if (positions[child].empty())
+		{
+			continue;
+		}
+		double left = timeLeft(chunk_start[child], last_result[child], now);
+		if (left < 0)
+		{
+			continue;
+		}
+		if (min_left < 0 || left < min_left)
+		{
+			min_left = left;
+		}
+	}
+	if (min_left < 0)
+	{
+		return NULL;
+	}
+	wait->tv_sec = (time_t) min_left;
+	wait->tv_usec = (suseconds_t) ((min_left - wait->tv_sec) * 1000000);
+	return wait;
+}
+
+/**
+ * Appends the name of the given file, followed by delim, to the chunk about to be sent to a child,
+ * and adds the file to the child's queue.
+ */
+void addToChunk(std::string& chunk, std::deque<FileSlot>& queue, const FileSlot& slot, char delim)
+{
+	chunk.append(slot.name, slot.len);
+	chunk += delim;
+	queue.push_back(slot);
+}
+
+/**
+ * Adds the files in queue whose results were not received yet to retry.
+ */
+void retryUndone(const std::deque<FileSlot>& queue, const std::vector<bool>& done,
+				 std::deque<FileSlot>& retry)
+{
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		if (!isDone(queue[i], done))
+		{
+			retry.push_back(queue[i]);
+		}
+	}
+}
+
+/**
+ * Where runPool puts the results.
+ */
+class ResultSink
+{
+public:
+	virtual ~ResultSink()
+	{
+	}
+
+	/**
+	 * Called once before any result, with the number of inputs, or -1 if it is not known
+	 * (the inputs of a list are counted as they are dispatched).
+	 */
+	virtual void begin(int total) = 0;
+
+	/**
+	 * Called once with the result of every input, in no particular order.
+	 */
+	virtual void put(const FileSlot& slot, const std::string& result) = 0;
+};
+
+/**
+ * Puts the result of the i'th input into the i'th string of a vector.
+ */
+class VectorSink : public ResultSink
+{
+public:
+	VectorSink(std::vector<std::string>& outputs) : _outputs(outputs)
+	{
+	}
+
+	void begin(int total)
+	{
+		_outputs = std::vector<std::string>(std::max(total, 0), "");
+	}
+
+	void put(const FileSlot& slot, const std::string& result)
+	{
+		if (slot.file >= (int) _outputs.size())
+		{
+			_outputs.resize(slot.file + 1);
+		}
+		_outputs[slot.file] = result;
+	}
+
+private:
+	std::vector<std::string>& _outputs;
+};
+
+/**
+ * Returns the length of the valid UTF-8 sequence of 2 to 4 bytes starting at str (of len
+ * bytes), or 0 if it is not one - a stray or overlong one, a surrogate or past U+10FFFF.
+ */
+size_t utf8Length(const unsigned char* str, size_t len)
+{
+	size_t seq_len;
+	unsigned char low = 0x80;
+	unsigned char high = 0xbf;
+	if (str[0] >= 0xc2 && str[0] <= 0xdf)
+	{
+		seq_len = 2;
+	}
+	else if (str[0] >= 0xe0 && str[0] <= 0xef)
+	{
+		seq_len = 3;
+		low = (str[0] == 0xe0) ? 0xa0 : low;
+		high = (str[0] == 0xed) ? 0x9f : high;
+	}
+	else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+	{
+		seq_len = 4;
+		low = (str[0] == 0xf0) ? 0x90 : low;
+		high = (str[0] == 0xf4) ? 0x8f : high;
+	}
+	else
+	{
+		return 0;
+	}
+	if (len < seq_len || str[1] < low || str[1] > high)
+	{
+		return 0;
+	}
+	for (size_t i = 2; i < seq_len; ++i)
+	{
+		if (str[i] < 0x80 || str[i] > 0xbf)
+		{
+			return 0;
+		}
+	}
+	return seq_len;
+}
+
+/**
+ * Appends the len bytes at str to out as a JSON string, quotes included.
+ * Paths and results are bytes, not necessarily UTF-8 - a byte that is not part of a valid
+ * UTF-8 sequence is written as the lone surrogate \udcXX (like Python's surrogateescape),
+ * so the output stays valid UTF-8 and the original bytes can still be recovered.
+ */
+void appendJson(std::string& out, const char* str, size_t len)
+{
+	static const char* HEX = "0123456789abcdef";
+	out += '"';
+	for (size_t i = 0; i < len; ++i)
+	{
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			out += "\\u00";
+			out += HEX[c >> 4];
+			out += HEX[c & 0xf];
+		}
+		else if (c < 0x80)
+		{
+			out += c;
+		}
+		else
+		{
+			size_t seq_len = utf8Length((const unsigned char*) str + i, len - i);
+			if (seq_len == 0)
+			{
+				out += "\\udc";
+				out += HEX[c >> 4];
+				out += HEX[c & 0xf];
+				continue;
+			}
+			out.append(str + i, seq_len);
+			i += seq_len - 1;
+		}
+	}
+	out += '"';
+}
+
+/**
+ * Returns the header of the binary record at offset in data. Records are not aligned,
+ * so the header is copied out instead of being read in place.
+ */
+pft_record_header recordHeader(const char* data, uint64_t offset)
+{
+	pft_record_header header;
+	memcpy(&header, data + offset, sizeof(header));
+	return header;
+}
+
+/**
+ * Orders offsets of binary records in a mapped output file by the records' paths.
+ */
+struct RecordPathLess
+{
+	const char* data;
+
+	bool operator()(uint64_t a, uint64_t b) const
+	{
+		pft_record_header header_a = recordHeader(data, a);
+		pft_record_header header_b = recordHeader(data, b);
+		int res = memcmp(data + a + sizeof(header_a), data + b + sizeof(header_b),
+						 std::min(header_a.path_len, header_b.path_len));
+		return res < 0 || (res == 0 && header_a.path_len < header_b.path_len);
+	}
+};
+
+/**
+ * Writes the results straight to an output file, in one of the pft_sink_format formats,
+ * instead of keeping them in memory. Results are serialized into large batches which a
+ * background thread writes with pwrite, so the children are never waiting for the disk.
+ */
+class FileSink : public ResultSink
+{
+public:
+	/**
+	 * Writes to fd, which must be open for reading and writing, and starts the writing thread.
+	 */
+	FileSink(int fd, pft_sink_format format) :
+		_fd(fd), _format(format), _size(0), _written(0), _closing(false), _failed(false),
+		_thread(&FileSink::writeLoop, this)
+	{
+	}
+
+	~FileSink()
+	{
+		stopWriting();
+	}
+
+	void begin(int total)
+	{
+		if (_format == PFT_SINK_BINARY)
+		{
+			append(PFT_BINARY_MAGIC, sizeof(PFT_BINARY_MAGIC));
+		}
+		else if (_format == PFT_SINK_INDEX)
+		{
+			append(PFT_INDEX_MAGIC, sizeof(PFT_INDEX_MAGIC));
+			_offsets.reserve(std::max(total, 0));
+		}
+	}
+
+	void put(const FileSlot& slot, const std::string& result)
+	{
+		if (_format == PFT_SINK_NDJSON)
+		{
+			std::string line = "{\"index\":" + std::to_string(slot.file) + ",\"path\":";
+			appendJson(line, slot.name, slot.len);
+			line += ",\"result\":";
+			appendJson(line, result.data(), result.size());
+			line += "}\n";
+			append(line.data(), line.size());
+			return;
+		}
+
+		if (_format == PFT_SINK_INDEX)
+		{
+			_offsets.push_back(_size);
+		}
+		pft_record_header header;
+		header.index = slot.file;
+		header.path_len = slot.len;
+		header.result_len = result.size();
+		append((const char*) &header, sizeof(header));
+		append(slot.name, slot.len);
+		append(result.data(), result.size());
+	}
+
+	/**
+	 * Writes what is left, and for an index the path-sorted offsets table and footer.
+	 * Returns CODE_FAIL if any write failed.
+	 */
+	int finish()
+	{
+		stopWriting();
+		if (_failed)
+		{
+			return CODE_FAIL;
+		}
+		if (_format != PFT_SINK_INDEX)
+		{
+			return CODE_SUCCESS;
+		}
+
+		// Sort by path, reading the paths back from the records already in the file
+		if (_size > 0)
+		{
+			void* map = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+			if (map == MAP_FAILED)
+			{
+				return CODE_FAIL;
+			}
+			RecordPathLess less = {(const char*) map};
+			std::sort(_offsets.begin(), _offsets.end(), less);
+			munmap(map, _size);
+		}
+
+		pft_index_footer footer;
+		footer.table_offset = _size;
+		footer.count = _offsets.size();
+		memcpy(footer.magic, PFT_INDEX_MAGIC, sizeof(footer.magic));
+		if (!writeAt((const char*) _offsets.data(), _offsets.size() * sizeof(uint64_t), _size) ||
+			!writeAt((const char*) &footer, sizeof(footer),
+					 _size + _offsets.size() * sizeof(uint64_t)))
+		{
+			return CODE_FAIL;
+		}
+		return CODE_SUCCESS;
+	}
+
+private:
+	/**
+	 * Appends bytes to the current batch, handing it to the writing thread once it is large.
+	 */
+	void append(const char* bytes, size_t len)
+	{
+		_batch.append(bytes, len);
+		_size += len;
+		if (_batch.size() >= SINK_BATCH_SIZE)
+		{
+			submit();
+		}
+	}
+
+	/**
+	 * Hands the current batch to the writing thread, waiting if too many are already queued.
+	 */
+	void submit()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cond.wait(lock, [this] { return _queue.size() < SINK_MAX_BATCHES; });
+		_queue.push_back(std::string());
+		_queue.back().swap(_batch);
+		_cond.notify_all();
+	}
+
+	/**
+	 * Submits the last batch and waits for the writing thread to write everything and exit.
+	 */
+	void stopWriting()
+	{
+		if (!_thread.joinable())
+		{
+			return;
+		}
+		if (!_batch.empty())
+		{
+			submit();
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_closing = true;
+		}
+		_cond.notify_all();
+		_thread.join();
+	}
+
+	/**
+	 * Writes all len bytes at bytes to the file at the given offset.
+	 */
+	bool writeAt(const char* bytes, size_t len, uint64_t offset)
+	{
+		while (len > 0)
+		{
+			ssize_t written = pwrite(_fd, bytes, len, offset);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			bytes += written;
+			len -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	/**
+	 * The writing thread - writes the queued batches in order until told to close.
+	 * After a failed write the rest are dropped, so the parse loop never blocks on it.
+	 */
+	void writeLoop()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (true)
+		{
+			_cond.wait(lock, [this] { return _closing || !_queue.empty(); });
+			if (_queue.empty())
+			{
+				return;
+			}
+			std::string batch;
+			batch.swap(_queue.front());
+			lock.unlock();
+
+			if (!_failed && !writeAt(batch.data(), batch.size(), _written))
+			{
+				_failed = true;
+			}
+			_written += batch.size();
+
+			lock.lock();
+			_queue.pop_front();
+			_cond.notify_all();
+		}
+	}
+
+	int _fd;
+	pft_sink_format _format;
+	// Bytes produced up to now, and written by the thread up to now
+	uint64_t _size;
+	uint64_t _written;
+	// Batch being filled, and batches waiting for the thread
+	std::string _batch;
+	std::deque<std::string> _queue;
+	// Record offsets, for an index
+	std::vector<uint64_t> _offsets;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	bool _closing;
+	bool _failed;
+	std::thread _thread;
+};
+
+/**
+ * Runs cmd over every input using the current children, putting the result of every input into sink.
+ * A child that exceeds a timeout is killed and replaced, the file it was working on is
+ * reported as PFT_TIMED_OUT and the rest of its chunk is sent again.
+ * When speculating, an idle child copies the unanswered files of the slowest child in reverse
+ * order, so the file the straggler is stuck on comes last. Both keep working and the first
+ * result of each file wins. Files the loser did not answer yet when the call ends are left
+ * to it as stale work, so it is not killed just for being the second one.
+ * Errors are reported under the given function name.
+ */
+int dispatchAll(const std::string& func, const pft_cmd_struct& cmd,
+				InputSource& inputs, ResultSink& sink)
+{
+	// Init results. The inputs of a list are only counted as they are dispatched.
+	sink.begin(inputs.size());
+	if (inputs.empty())
+	{
+		return CODE_SUCCESS;
+	}
+	// index of next file name to write
+	int to_write = 0;
+
+	// Number of files to send each time. With less files than children, every file goes to
+	// its own child and the rest stay idle, so small batches do not respawn the children.
+	// Only that many files need to be counted in advance.
+	int upcoming_files = inputs.countUpTo(DEFAULT_CHUNK_SIZE * para_level);
+	int send_files_n = std::max(1, std::min(DEFAULT_CHUNK_SIZE, upcoming_files/para_level));
+
+	// Queue of files for each child
+	std::vector< std::deque<FileSlot> > positions(para_level);
+	// Output of each child not yet forming a complete result
+	std::vector<std::string> pending(para_level);
+	// Files taken back from replaced children, sent again before new ones
+	std::deque<FileSlot> retry;
+	// Whether the result of each file was already received, from any child
+	std::vector<bool> done;
+	done.reserve(std::max(inputs.size(), 0));
+	// Whether the work of each child is also done by another one
+	std::vector<bool> duplicated(para_level, false);
+	// When each child got its chunk, and when it last returned a result
+	std::vector<timeval> chunk_start(para_level);
+	std::vector<timeval> last_result(para_level);
+
+	// Number of files dispatched and still not handled
+	int remaining_read_files = 0;
+
+	// Stats
+	timeval begin;
+	timeval end;
+	timeval now;
+	if (gettimeofday(&begin, NULL) != CODE_SUCCESS)
+	{
+		return CODE_FAIL;
+	}
+	now = begin;
+
+	// Children still working on files of the last call answer them first
+	FileSlot stale_slot = {-1, NULL, 0};
+	for (int child = 0; child < para_level; ++child)
+	{
+		positions[child].assign(stale_results[child], stale_slot);
+		pending[child].swap(stale_pending[child]);
+		stale_results[child] = 0;
+		stale_pending[child].clear();
+		chunk_start[child] = now;
+		last_result[child] = now;
+	}
+
+	while(remaining_read_files > 0 || !inputs.empty())
+	{
+		// While not all files handled
+		if (!childrenAlive)
+		{
+			// Child died
+			setError(func, ERROR_CHILD);
+			return CODE_FAIL;
+		}
+
+		// Write to children
+		for(int child = 0; child < para_level; ++child)
+		{
+			if(!positions[child].empty())
+			{
+				continue;
+			}
+
+			// Child finished previous work
+			std::string filenames = "";
+			if (!retry.empty() || !inputs.empty())
+			{
+				// Files of replaced children first, then new ones
+				while ((int) positions[child].size() < send_files_n && !retry.empty())
+				{
+					if (!isDone(retry.front(), done))
+					{
+						addToChunk(filenames, positions[child], retry.front(), cmd.in_delim);
+					}
+					retry.pop_front();
+				}
+				FileSlot slot;
+				for (; (int) positions[child].size() < send_files_n && inputs.next(slot.name, slot.len);
+					 ++to_write)
+				{
+					// Create input string, counting the input
+					slot.file = to_write;
+					done.push_back(false);
+					++remaining_read_files;
+					addToChunk(filenames, positions[child], slot, cmd.in_delim);
+				}
+				duplicated[child] = false;
+			}
+			else if (timeouts.speculate)
+			{
+				// No new work - duplicate the work of the slowest child, in reverse order, so
+				// the file it is stuck on comes last and the copy answers all the others first
+				int straggler = findStraggler(positions, duplicated, last_result, done);
+				if (straggler < 0)
+				{
+					continue;
+				}
+				for (size_t i = positions[straggler].size(); i > 0; --i)
+				{
+					if (!isDone(positions[straggler][i - 1], done))
+					{
+						addToChunk(filenames, positions[child], positions[straggler][i - 1],
+								   cmd.in_delim);
+					}
+				}
+				duplicated[straggler] = true;
+				duplicated[child] = true;
+			}
+
+			if (positions[child].empty())
+			{
+				continue;
+			}
+			try
+			{
+				// Write it to child
+				writeToChild(child, filenames);
+			}
+			catch (const std::string& str)
+			{
+				// Write problem
+				setError(func, str);
+				return CODE_FAIL;
+			}
+			PFT_TRACE(duplicated[child] ? TRACE_SPECULATE : TRACE_DISPATCH, child,
+					  positions[child].size());
+			chunk_start[child] = now;
+			last_result[child] = now;
+		}
+
+		// Wait until we can read, or until a child times out
+		timeval wait;
+		fd_set ready_reads = getReadFDs();
+		PFT_TRACE_BEGIN(select_start);
+		int ready = select(getMaxFD() + 1, &ready_reads, NULL, NULL,
+						   nextTimeout(positions, chunk_start, last_result, &now, &wait));
+		PFT_TRACE_END(TRACE_SELECT, -1, ready, select_start);
+		if (ready < 0)
+		{
+			FD_ZERO(&ready_reads);
+		}
+		if (gettimeofday(&now, NULL) != CODE_SUCCESS)
+		{
+			return CODE_FAIL;
+		}
+
+		// Read from children
+		for(int child = 0; child < para_level; ++child)
+		{
+			int read_fd = FDReadFromChild(child);
+			if(remaining_read_files > 0 && FD_ISSET(read_fd, &ready_reads))
+			{
+				// Can read from child, and not all files read
+				PFT_TRACE_BEGIN(read_start);
+				bool closed;
+				try
+				{
+					// Read from child
+					pending[child] += readAllFromChild(child, closed);
+				}
+				catch (const std::string& str)
+				{
+					// Read problem
+					setError(func, str);
+					return CODE_FAIL;
+				}
+
+				PFT_TRACE_END(TRACE_READ, child, pending[child].size(), read_start);
+
+				// Add complete results to sink, keep a cut result for the next read.
+				// A result of a duplicated file counts only if it is the first one.
+				PFT_TRACE_BEGIN(parse_start);
+				size_t pos = 0;
+				int results = 0;
+				std::string record;
+				while (!positions[child].empty() &&
+					   nextRecord(cmd.framing, pending[child], pos, record))
+				{
+					FileSlot slot = positions[child].front();
+					positions[child].pop_front();
+					last_result[child] = now;
+					++results;
+					if (!isDone(slot, done))
+					{
+						sink.put(slot, record);
+						done[slot.file] = true;
+						remaining_read_files--;
+						PFT_TRACE(TRACE_RESULT, child, slot.file);
+					}
+				}
+				pending[child].erase(0, pos);
+				PFT_TRACE_END(TRACE_PARSE, child, results, parse_start);
+
+				// A worker which died - its current file gets PFT_WORKER_CRASHED, the rest is sent again
+				if (closed)
+				{
+					if (!positions[child].empty())
+					{
+						FileSlot slot = positions[child].front();
+						positions[child].pop_front();
+						if (!isDone(slot, done))
+						{
+							sink.put(slot, PFT_WORKER_CRASHED);
+							done[slot.file] = true;
+							remaining_read_files--;
+						}
+						retryUndone(positions[child], done, retry);
+					}
+					positions[child].clear();
+					pending[child].clear();
+					duplicated[child] = false;
+					try
+					{
+						respawnChild(child);
+					}
+					catch (const std::string& str)
+					{
+						setError(func, str);
+						return CODE_FAIL;
+					}
+				}
+			}
+		}
+
+		// Replace children which timed out - give up the current file, send the rest again
+		for(int child = 0; child < para_level && remaining_read_files > 0; ++child)
+		{
+			if (positions[child].empty() ||
+				!timedOut(chunk_start[child], last_result[child], &now))
+			{
+				continue;
+			}
+			FileSlot slot = positions[child].front();
+			positions[child].pop_front();
+			PFT_TRACE(TRACE_TIMEOUT, child, slot.file);
+			if (!isDone(slot, done))
+			{
+				sink.put(slot, PFT_TIMED_OUT);
+				done[slot.file] = true;
+				remaining_read_files--;
+			}
+			retryUndone(positions[child], done, retry);
+			positions[child].clear();
+			pending[child].clear();
+			duplicated[child] = false;
+			try
+			{
+				respawnChild(child);
+			}
+			catch (const std::string& str)
+			{
+				setError(func, str);
+				return CODE_FAIL;
+			}
+		}
+	}
+
+	// Children still working on duplicated files keep them for the next call
+	for(int child = 0; child < para_level; ++child)
+	{
+		stale_results[child] = positions[child].size();
+		stale_pending[child].swap(pending[child]);
+	}
+
+	// Stats
+	if (gettimeofday(&end, NULL) != CODE_SUCCESS)
+	{
+		return CODE_FAIL;
+	}
+	statFileNum += to_write;
+	statTime += calcTimeDiff(&begin, &end);
+
+	// Done!
+	return CODE_SUCCESS;
+}
+
+/**
+ * Runs cmd over every input using the children, putting the result of every input into sink.
+ * The children are respawned first if they run a different program. If the call fails they are
+ * torn down, as they may still hold inputs or results of it, and the next call spawns new ones.
+ * Errors are reported under the given function name.
+ */
+int runPool(const std::string& func, const pft_cmd_struct& cmd,
+			InputSource& inputs, ResultSink& sink)
+{
+	if (cmd.path.empty() || cmd.argv.empty() || access(cmd.path.c_str(), X_OK) < 0)
+	{
+		setError(func, ERROR_CMD);
+		return CODE_FAIL;
+	}
+
+	// Respawn the children if they run another program, or failed to start the last time
+	if (!sameProgram(cmd, currentCmd()) || !pipes_inited)
+	{
+		cur_cmd = cmd;
+		if (setParallelismLevel(para_level) == CODE_FAIL)
+		{
+			setError(func, pft_get_error());
+			return CODE_FAIL;
+		}
+	}
+	cur_cmd = cmd;
+
+	if (dispatchAll(func, cmd, inputs, sink) == CODE_FAIL)
+	{
+		resetPool();
+		return CODE_FAIL;
+	}
+	return CODE_SUCCESS;
+}
+
+/**
+ * Runs the command cmd on each input in the given vector using n parallelism level.
+ * Every input is written to a child followed by cmd.in_delim, and every result the child
+ * writes back is cut according to cmd.framing and put into the same index in outputs.
+ * The command must answer the inputs in order, one result per input, flushing every result.
+ *
+ * The function fails if cmd has no path or arguments, if its path is not an executable,
+ * or if a system call failed.
+ *
+ * Parameters:
+ * 	cmd - the command to run.
+ * 	inputs - the inputs to pass the command.
+ * 	outputs - a vector that will be initialized with the results of cmd on each input.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_run error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_run(const pft_cmd_struct& cmd, std::vector<std::string>& inputs,
+			std::vector<std::string>& outputs)
+{
+	InputSource source(inputs);
+	VectorSink sink(outputs);
+	return runPool(FUNC_RUN, cmd, source, sink);
+}
+
+/**
+ * Maps the file list at list_path, whose records are ended by delim, and runs cmd over them
+ * using the children. Errors are reported under the given function name.
+ */
+int runOnListFile(const std::string& func, const pft_cmd_struct& cmd, const char* list_path,
+				  char delim, ResultSink& sink)
+{
+	if (!list_path)
+	{
+		setError(func, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	int fd = open(list_path, O_RDONLY);
+	struct stat list_stat;
+	if (fd < 0 || fstat(fd, &list_stat) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		setError(func, ERROR_OPEN);
+		return CODE_FAIL;
+	}
+
+	// An empty list can not be mapped, but has no records anyway
+	size_t len = list_stat.st_size;
+	void* map = nullptr;
+	if (len > 0)
+	{
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close(fd);
+			setError(func, ERROR_MMAP);
+			return CODE_FAIL;
+		}
+		madvise(map, len, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	InputSource source((const char*) map, len, delim);
+	int res = runPool(func, cmd, source, sink);
+	if (map)
+	{
+		munmap(map, len);
+	}
+	return res;
+}
+
+/**
+ * Same as pft_run, but the inputs are the records of the len bytes at buf, each ended by delim
+ * (the last one may be unterminated). Chunks are built straight from buf.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_run_buf error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_run_buf(const pft_cmd_struct& cmd, const char* buf, size_t len, char delim,
+				std::vector<std::string>& outputs)
+{
+	if (!buf && len > 0)
+	{
+		setError(FUNC_RUN_BUF, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	InputSource source(buf, len, delim);
+	VectorSink sink(outputs);
+	return runPool(FUNC_RUN_BUF, cmd, source, sink);
+}
+
+/**
+ * Same as pft_run, but the inputs are the records of the file at list_path, each ended by delim.
+ * The file is mapped into memory and chunks are built straight from the mapped bytes.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_run_file error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_run_file(const pft_cmd_struct& cmd, const char* list_path, char delim,
+				 std::vector<std::string>& outputs)
+{
+	VectorSink sink(outputs);
+	return runOnListFile(FUNC_RUN_FILE, cmd, list_path, delim, sink);
+}
+
+/**
+ * This function uses ‘file’ to calculate the type of each file in the given vector
+ * using n parallelism level.
+ * It gets a vector contains the name of the files to check (file_names_vec) and an
+ * empty vector (types_vec).
+ * The function runs "file" command on each file in the file_names_vec (even if it is not a valid
+ * file) using n parallelism level,
+ * and insert its result to the same index in types_vec.
+ *
+ * The function fails if any of his parameters is null, if types_vec is not an empty vector or
+ * if a system called failed
+ * (for example fork failed).
+ *
+ * Parameters:
+ * 	file_names_vec - a vector contains the absolute or relative paths of the files to check.
+ * 	types_vec - an empty vector that will be initialized with the results of "file" command on
+ * 	each file in file_names_vec.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_find_types error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_find_types(std::vector<std::string>& file_names_vec, std::vector<std::string>& types_vec)
+{
+	InputSource source(file_names_vec);
+	VectorSink sink(types_vec);
+	return runPool(FUNC_FIND_TYPES, typesCmd(), source, sink);
+}
+
+/**
+ * Same as pft_find_types, but the file names are the records of the file at list_path, each
+ * ended by delim ('\n' or '\0'), e.g the output of "find -print0".
+ * The list is mapped into memory and never copied name by name.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_find_types_file error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_find_types_file(const char* list_path, char delim, std::vector<std::string>& types_vec)
+{
+	VectorSink sink(types_vec);
+	return runOnListFile(FUNC_FIND_TYPES_FILE, typesCmd(), list_path, delim, sink);
+}
+
+/**
+ * Creates the output file at out_path and runs cmd over the inputs, either the strings of
+ * inputs_vec or, if it is null, the records of the file list at list_path, writing the results
+ * to the output file in the given format. Errors are reported under the given function name.
+ */
+int runToFile(const std::string& func, const pft_cmd_struct& cmd,
+			  std::vector<std::string>* inputs_vec, const char* list_path, char delim,
+			  const char* out_path, pft_sink_format format)
+{
+	if (!out_path)
+	{
+		setError(func, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	if (format != PFT_SINK_NDJSON && format != PFT_SINK_BINARY && format != PFT_SINK_INDEX)
+	{
+		setError(func, ERROR_SINK_FORMAT);
+		return CODE_FAIL;
+	}
+	int fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, SINK_FILE_MODE);
+	if (fd < 0)
+	{
+		setError(func, ERROR_SINK_OPEN);
+		return CODE_FAIL;
+	}
+
+	int res;
+	{
+		FileSink sink(fd, format);
+		if (inputs_vec)
+		{
+			InputSource source(*inputs_vec);
+			res = runPool(func, cmd, source, sink);
+		}
+		else
+		{
+			res = runOnListFile(func, cmd, list_path, delim, sink);
+		}
+		if (sink.finish() == CODE_FAIL && res == CODE_SUCCESS)
+		{
+			setError(func, ERROR_SINK_WRITE);
+			res = CODE_FAIL;
+		}
+	}
+	if (close(fd) < 0 && res == CODE_SUCCESS)
+	{
+		setError(func, ERROR_SINK_WRITE);
+		res = CODE_FAIL;
+	}
+	return res;
+}
+
+/**
+ * Same as pft_run, but the results are written straight to the file at out_path in the given
+ * format, instead of being kept in a vector.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_run_to_file error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_run_to_file(const pft_cmd_struct& cmd, std::vector<std::string>& inputs,
+					const char* out_path, pft_sink_format format)
+{
+	return runToFile(FUNC_RUN_TO_FILE, cmd, &inputs, NULL, NEWLINE, out_path, format);
+}
+
+/**
+ * Same as pft_find_types, but the types are written straight to the file at out_path in the
+ * given format, instead of being kept in a vector.
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_find_types_to_file error:" should be obtained by
+ * 	using the pft_get_error().
  */
-double calcTimeDiff(timeval* t1, timeval* t2)
+int pft_find_types_to_file(std::vector<std::string>& file_names_vec, const char* out_path,
+						   pft_sink_format format)
 {
-	timeval res;
-	timersub(t2, t1, &res);
-	return res.tv_sec + res.tv_usec / 1000000.0;
+	return runToFile(FUNC_FIND_TYPES_TO_FILE, typesCmd(), &file_names_vec, NULL, NEWLINE,
+					 out_path, format);
 }
 
 /**
- * This function uses ‘file’ to calculate the type of each file in the given vector
- * using n parallelism level.
- * It gets a vector contains the name of the files to check (file_names_vec) and an
- * empty vector (types_vec).
- * The function runs "file" command on each file in the file_names_vec (even if it is not a valid
- * file) using n parallelism level,
- * and insert its result to the same index in types_vec.
- *
- * The function fails if any of his parameters is null, if types_vec is not an empty vector or
- * if a system called failed
- * (for example fork failed).
- *
- * Parameters:
- * 	file_names_vec - a vector contains the absolute or relative paths of the files to check.
- * 	types_vec - an empty vector that will be initialized with the results of "file" command on
- * 	each file in file_names_vec.
+ * Same as pft_find_types_file, but the types are written straight to the file at out_path in
+ * the given format - neither the names nor the types are ever all in memory.
  * Return value:
  * 	On success return SUCCESS, on error return FAILURE.
- * 	A valid error message, started with "pft_find_types error:" should be obtained by
+ * 	A valid error message, started with "pft_find_types_file_to_file error:" should be
+ * 	obtained by using the pft_get_error().
+ */
+int pft_find_types_file_to_file(const char* list_path, char delim, const char* out_path,
+								pft_sink_format format)
+{
+	return runToFile(FUNC_FIND_TYPES_FILE_TO_FILE, typesCmd(), NULL, list_path, delim,
+					 out_path, format);
+}
+
+/**
+ * Reads the offset of the index'th record from an index table, which may not be aligned, into
+ * offset and the record's header into header. Returns false if the record does not lie within
+ * the records part of the file, between the magic and the table at table_offset.
+ */
+bool indexRecord(const char* data, uint64_t table_offset, uint64_t index,
+				 uint64_t& offset, pft_record_header& header)
+{
+	memcpy(&offset, data + table_offset + index * sizeof(uint64_t), sizeof(offset));
+	if (offset < sizeof(PFT_INDEX_MAGIC) || offset > table_offset ||
+		table_offset - offset < sizeof(header))
+	{
+		return false;
+	}
+	header = recordHeader(data, offset);
+	return (uint64_t) header.path_len + header.result_len <= table_offset - offset - sizeof(header);
+}
+
+/**
+ * Finds the result of path in the PFT_SINK_INDEX file at index_path, by a binary search
+ * over its path-sorted offsets table. Every offset and record is checked against the file's
+ * bounds, so a damaged index fails instead of reading past the mapping.
+ * Return value:
+ * 	On success return SUCCESS, on error (or if path is not in the index) return FAILURE.
+ * 	A valid error message, started with "pft_index_lookup error:" should be obtained by
  * 	using the pft_get_error().
  */
-int pft_find_types(std::vector<std::string>& file_names_vec, std::vector<std::string>& types_vec)
+int pft_index_lookup(const char* index_path, const std::string& path, std::string& result)
 {
-	// Number of files
-	int total_files = file_names_vec.size();
-	// Init types vector
-	types_vec = std::vector<std::string>(total_files, "");
-	// index of next file name to write
-	int to_write = 0;
-	// Number of files to send each time
-	int send_files_n = std::min(DEFAULT_CHUNK_SIZE, total_files/para_level);
+	if (!index_path)
+	{
+		setError(FUNC_INDEX_LOOKUP, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	struct stat index_stat;
+	if (fd < 0 || fstat(fd, &index_stat) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		setError(FUNC_INDEX_LOOKUP, ERROR_OPEN);
+		return CODE_FAIL;
+	}
+	size_t len = index_stat.st_size;
+	if (len < sizeof(PFT_INDEX_MAGIC) + sizeof(pft_index_footer))
+	{
+		close(fd);
+		setError(FUNC_INDEX_LOOKUP, ERROR_INDEX);
+		return CODE_FAIL;
+	}
+	void* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		setError(FUNC_INDEX_LOOKUP, ERROR_MMAP);
+		return CODE_FAIL;
+	}
+
+	// The footer ends the file, so it may not be aligned either
+	const char* data = (const char*) map;
+	pft_index_footer footer;
+	memcpy(&footer, data + len - sizeof(footer), sizeof(footer));
+	uint64_t table_end = len - sizeof(footer);
+	if (memcmp(data, PFT_INDEX_MAGIC, sizeof(PFT_INDEX_MAGIC)) != 0 ||
+		memcmp(footer.magic, PFT_INDEX_MAGIC, sizeof(footer.magic)) != 0 ||
+		footer.table_offset < sizeof(PFT_INDEX_MAGIC) || footer.table_offset > table_end ||
+		footer.count != (table_end - footer.table_offset) / sizeof(uint64_t) ||
+		(table_end - footer.table_offset) % sizeof(uint64_t) != 0)
+	{
+		munmap(map, len);
+		setError(FUNC_INDEX_LOOKUP, ERROR_INDEX);
+		return CODE_FAIL;
+	}
 
-	// Change parallesim level if it is larger than number of files
-	if(total_files < para_level)
+	// Binary search for the first record whose path is not less than path
+	uint64_t offset;
+	pft_record_header header;
+	uint64_t low = 0;
+	uint64_t high = footer.count;
+	while (low < high)
 	{
-		if (setParallelismLevel(total_files) == CODE_FAIL)
+		uint64_t mid = low + (high - low) / 2;
+		if (!indexRecord(data, footer.table_offset, mid, offset, header))
+		{
+			munmap(map, len);
+			setError(FUNC_INDEX_LOOKUP, ERROR_INDEX);
+			return CODE_FAIL;
+		}
+		int res = memcmp(data + offset + sizeof(header), path.data(),
+						 std::min<size_t>(header.path_len, path.size()));
+		if (res < 0 || (res == 0 && header.path_len < path.size()))
+		{
+			low = mid + 1;
+		}
+		else
 		{
-			setError(FUNC_FIND_TYPES, pft_get_error());
+			high = mid;
 		}
 	}
 
-	// Queue of files for each child
-	std::vector< std::queue<int> > positions(para_level);
+	std::string error = ERROR_NOT_FOUND;
+	if (low < footer.count)
+	{
+		if (!indexRecord(data, footer.table_offset, low, offset, header))
+		{
+			error = ERROR_INDEX;
+		}
+		else
+		{
+			const char* record_path = data + offset + sizeof(header);
+			if (header.path_len == path.size() &&
+				memcmp(record_path, path.data(), path.size()) == 0)
+			{
+				result.assign(record_path + header.path_len, header.result_len);
+				error.clear();
+			}
+		}
+	}
+	munmap(map, len);
+	if (!error.empty())
+	{
+		setError(FUNC_INDEX_LOOKUP, error);
+		return CODE_FAIL;
+	}
+	return CODE_SUCCESS;
+}
 
-	// Number of files still not handled
-	int remaining_read_files = total_files;
+/**
+ * Watches dir and all the directories under it, recording every watch in wds.
+ * If files is not null, the paths of all the non-directories found are added to it.
+ * Returns false if dir itself can not be watched.
+ */
+bool watchTree(int inotify_fd, const std::string& dir, std::map<int, std::string>& wds,
+			   std::set<std::string>* files)
+{
+	int wd = inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK);
+	if (wd < 0)
+	{
+		return false;
+	}
+	wds[wd] = dir;
 
-	// FDs
-	int max_fd = getMaxFD()+1;
-	fd_set reads = getReadFDs();
+	DIR* dir_stream = opendir(dir.c_str());
+	if (!dir_stream)
+	{
+		return true;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir_stream)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+		std::string path = dir + SLASH + entry->d_name;
+		bool is_dir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN)
+		{
+			struct stat path_stat;
+			is_dir = lstat(path.c_str(), &path_stat) == 0 && S_ISDIR(path_stat.st_mode);
+		}
 
-	// Stats
-	timeval begin;
-	timeval end;
-	if (gettimeofday(&begin, NULL) != CODE_SUCCESS)
+		// A subdirectory that vanished meanwhile is simply not watched
+		if (is_dir)
+		{
+			watchTree(inotify_fd, path, wds, files);
+		}
+		else if (files)
+		{
+			files->insert(path);
+		}
+	}
+	closedir(dir_stream);
+	return true;
+}
+
+/**
+ * Stops watching dir and all the directories under it, e.g after it was moved away.
+ */
+void unwatchTree(int inotify_fd, const std::string& dir, std::map<int, std::string>& wds)
+{
+	std::string prefix = dir + SLASH;
+	for (std::map<int, std::string>::iterator it = wds.begin(); it != wds.end(); )
 	{
-		return CODE_FAIL;
+		if (it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0)
+		{
+			inotify_rm_watch(inotify_fd, it->first);
+			wds.erase(it++);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+/**
+ * Marks every indexed path under dir as removed, and forgets pending changes under it.
+ */
+void removeTree(const std::string& dir, const std::map<std::string, std::string>& index,
+				std::set<std::string>& changed, std::set<std::string>& removed)
+{
+	std::string prefix = dir + SLASH;
+	std::map<std::string, std::string>::const_iterator it = index.lower_bound(prefix);
+	for (; it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+	{
+		removed.insert(it->first);
+	}
+	std::set<std::string>::iterator changed_it = changed.lower_bound(prefix);
+	while (changed_it != changed.end() && changed_it->compare(0, prefix.size(), prefix) == 0)
+	{
+		changed.erase(changed_it++);
 	}
+}
 
-	while(remaining_read_files > 0)
+/**
+ * Walks all the roots again after the kernel dropped events: every file in them is considered
+ * changed, and every indexed path under them that is not there anymore is considered removed.
+ * Sets root_gone if a root can not be watched anymore.
+ */
+void rescanRoots(int inotify_fd, const std::vector<std::string>& roots,
+				 std::map<int, std::string>& wds, const std::map<std::string, std::string>& index,
+				 std::set<std::string>& changed, std::set<std::string>& removed, bool& root_gone)
+{
+	std::set<std::string> found;
+	for (size_t i = 0; i < roots.size(); ++i)
 	{
-		// While not all files handled
-		if (!childrenAlive)
+		if (!watchTree(inotify_fd, roots[i], wds, &found))
 		{
-			// Child died
-			setError(FUNC_FIND_TYPES, ERROR_CHILD);
-			return CODE_FAIL;
+			root_gone = true;
+		}
+	}
+	for (size_t i = 0; i < roots.size(); ++i)
+	{
+		std::string prefix = roots[i] + SLASH;
+		std::map<std::string, std::string>::const_iterator it = index.lower_bound(prefix);
+		for (; it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+		{
+			if (found.count(it->first) == 0)
+			{
+				changed.erase(it->first);
+				removed.insert(it->first);
+			}
 		}
+	}
+	for (std::set<std::string>::iterator it = found.begin(); it != found.end(); ++it)
+	{
+		removed.erase(*it);
+		changed.insert(*it);
+	}
+}
 
-		// Write to children
-		for(int child = 0; child < para_level && to_write < total_files; ++child)
+/**
+ * Reads the pending file events and records the affected paths in changed or removed.
+ * New directories are watched and their files are considered changed. If the kernel dropped
+ * events, the roots are rescanned. If a root itself was deleted or moved, all its indexed
+ * paths are considered removed and root_gone is set.
+ */
+void readEvents(int inotify_fd, const std::vector<std::string>& roots,
+				std::map<int, std::string>& wds, const std::map<std::string, std::string>& index,
+				std::set<std::string>& changed, std::set<std::string>& removed, bool& root_gone)
+{
+	std::vector<char> buf(EVENTS_BUF_SIZE);
+	int len = read(inotify_fd, buf.data(), buf.size());
+	if (len < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+		{
+			return;
+		}
+		throw ERROR_EVENTS;
+	}
+
+	for (int pos = 0; pos < len; )
+	{
+		const struct inotify_event* event = (const struct inotify_event*) (buf.data() + pos);
+		pos += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW)
+		{
+			rescanRoots(inotify_fd, roots, wds, index, changed, removed, root_gone);
+			continue;
+		}
+		if (event->mask & IN_IGNORED)
+		{
+			wds.erase(event->wd);
+			continue;
+		}
+		std::map<int, std::string>::const_iterator dir = wds.find(event->wd);
+		if (dir == wds.end())
+		{
+			continue;
+		}
+		if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
+			std::find(roots.begin(), roots.end(), dir->second) != roots.end())
 		{
-			if(positions[child].empty())
+			// Nothing under it can be watched anymore
+			removeTree(dir->second, index, changed, removed);
+			root_gone = true;
+			continue;
+		}
+		if (event->len == 0)
+		{
+			continue;
+		}
+
+		std::string path = dir->second + SLASH + event->name;
+		bool gone = event->mask & (IN_DELETE | IN_MOVED_FROM);
+		if (event->mask & IN_ISDIR)
+		{
+			if (gone)
 			{
-				// Child finished previous work
-				std::string filenames = "";
-				for (int i = 0; i < send_files_n && to_write < total_files; ++i, ++to_write)
-				{
-					// Create input string
-					filenames += file_names_vec[to_write] + NEWLINE;
-					positions[child].push(to_write);
-				}
-				try
-				{
-					// Write it to child
-					writeToChild(child, filenames);
-				}
-				catch (const char* str)
-				{
-					// Write problem
-					setError(FUNC_FIND_TYPES, str);
-					return CODE_FAIL;
-				}
+				unwatchTree(inotify_fd, path, wds);
+				removeTree(path, index, changed, removed);
+			}
+			else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+			{
+				watchTree(inotify_fd, path, wds, &changed);
 			}
 		}
+		else if (gone)
+		{
+			changed.erase(path);
+			removed.insert(path);
+		}
+		else
+		{
+			removed.erase(path);
+			changed.insert(path);
+		}
+	}
+}
 
-		// Wait until we can read
-		fd_set ready_reads = reads;
-		select(max_fd, &ready_reads, NULL, NULL, NULL);
+/**
+ * Classifies the changed paths using the children, updates the index and passes the delta
+ * to the callback, setting stop to its return value.
+ * Returns CODE_FAIL, with the error already set, if the children failed.
+ */
+int flushChanges(std::set<std::string>& changed, std::set<std::string>& removed,
+				 std::map<std::string, std::string>& index, pft_watch_callback callback, void* arg,
+				 int& stop)
+{
+	pft_delta_struct delta;
+	for (std::set<std::string>::iterator it = removed.begin(); it != removed.end(); ++it)
+	{
+		if (index.erase(*it) > 0)
+		{
+			delta.removed.push_back(*it);
+		}
+	}
+	for (std::set<std::string>::iterator it = changed.begin(); it != changed.end(); ++it)
+	{
+		// Changed and then removed before we got to it
+		struct stat path_stat;
+		if (lstat(it->c_str(), &path_stat) < 0)
+		{
+			if (index.erase(*it) > 0)
+			{
+				delta.removed.push_back(*it);
+			}
+			continue;
+		}
+		delta.changed.push_back(*it);
+	}
+	changed.clear();
+	removed.clear();
 
-		// Read from children
-		for(int child = 0; child < para_level; ++child)
+	InputSource source(delta.changed);
+	VectorSink sink(delta.types);
+	if (runPool(FUNC_WATCH, typesCmd(), source, sink) == CODE_FAIL)
+	{
+		return CODE_FAIL;
+	}
+	for (size_t i = 0; i < delta.changed.size(); ++i)
+	{
+		index[delta.changed[i]] = delta.types[i];
+	}
+
+	if (!delta.changed.empty() || !delta.removed.empty())
+	{
+		stop = callback(delta, arg);
+	}
+	return CODE_SUCCESS;
+}
+
+/**
+ * Keeps index, mapping paths to their 'file' results, current with the files under roots.
+ * Created, modified and moved files are classified again by the children, in batches formed
+ * once no event arrived for debounce_ms, the oldest change waited WATCH_MAX_DEBOUNCES times
+ * that long, or a batch fills a chunk of every child.
+ * Deleted and moved away files are dropped from the index.
+ * Every batch is passed to callback as a delta. Watching stops when callback returns non-zero,
+ * or fails once a root itself is deleted or moved away (after passing its files as removed).
+ * Return value:
+ * 	On success return SUCCESS, on error return FAILURE.
+ * 	A valid error message, started with "pft_watch error:" should be obtained by
+ * 	using the pft_get_error().
+ */
+int pft_watch(const std::vector<std::string>& roots, std::map<std::string, std::string>& index,
+			  int debounce_ms, pft_watch_callback callback, void* arg)
+{
+	if (!callback)
+	{
+		setError(FUNC_WATCH, ERROR_NULLPTR);
+		return CODE_FAIL;
+	}
+	if (debounce_ms < 0)
+	{
+		setError(FUNC_WATCH, ERROR_DEBOUNCE);
+		return CODE_FAIL;
+	}
+
+	int inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0)
+	{
+		setError(FUNC_WATCH, ERROR_WATCH);
+		return CODE_FAIL;
+	}
+
+	// Roots without trailing slashes, so event paths match the index
+	std::vector<std::string> dirs;
+	std::map<int, std::string> wds;
+	for (size_t i = 0; i < roots.size(); ++i)
+	{
+		std::string dir = roots[i];
+		while (dir.size() > 1 && dir[dir.size() - 1] == SLASH)
 		{
-			int read_fd = FDReadFromChild(child);
-			if(remaining_read_files > 0 && FD_ISSET(read_fd, &ready_reads))
+			dir.erase(dir.size() - 1);
+		}
+		dirs.push_back(dir);
+		if (!watchTree(inotify_fd, dir, wds, NULL))
+		{
+			close(inotify_fd);
+			setError(FUNC_WATCH, ERROR_WATCH);
+			return CODE_FAIL;
+		}
+	}
+
+	// A full batch gives every child a whole chunk
+	size_t batch_size = para_level * DEFAULT_CHUNK_SIZE;
+	std::set<std::string> changed;
+	std::set<std::string> removed;
+	int stop = 0;
+	bool root_gone = false;
+	// When the oldest pending change arrived, so a steady stream of events can not hold it forever
+	timeval first_pending;
+	timeval now;
+	int max_wait_ms = WATCH_MAX_DEBOUNCES * debounce_ms;
+	try
+	{
+		while (!stop && !root_gone)
+		{
+			// Wait for events, or only debounce_ms more (at most until max_wait_ms passed since
+			// the oldest change) if changes are pending
+			struct pollfd poll_fd = {inotify_fd, POLLIN, 0};
+			bool pending = !changed.empty() || !removed.empty();
+			int wait_ms = -1;
+			if (pending)
 			{
-				// Can read from child, and not all files read
-				std::string output;
-				try
-				{
-					// Read from child
-					output = readAllFromChild(child);
-				}
-				catch (const char* str)
+				gettimeofday(&now, NULL);
+				int waited_ms = (int) (calcTimeDiff(&first_pending, &now) * MS_IN_SEC);
+				wait_ms = std::max(0, std::min(debounce_ms, max_wait_ms - waited_ms));
+			}
+			int ready = poll(&poll_fd, 1, wait_ms);
+			if (ready < 0 && errno != EINTR)
+			{
+				throw ERROR_EVENTS;
+			}
+			if (ready > 0)
+			{
+				readEvents(inotify_fd, dirs, wds, index, changed, removed, root_gone);
+			}
+			gettimeofday(&now, NULL);
+			if (!pending)
+			{
+				first_pending = now;
+			}
+			bool overdue = pending && calcTimeDiff(&first_pending, &now) * MS_IN_SEC >= max_wait_ms;
+			// A gone root ends the watch, after handing out the changes collected up to it
+			if ((ready == 0 && pending) || overdue || changed.size() + removed.size() >= batch_size ||
+				root_gone)
+			{
+				if (flushChanges(changed, removed, index, callback, arg, stop) == CODE_FAIL)
 				{
-					// Read problem
-					setError(FUNC_FIND_TYPES, str);
+					close(inotify_fd);
 					return CODE_FAIL;
 				}
-
-				int pos = 0;
-				// Add to types vec
-				while ((pos = output.find(NEWLINE)) != -1 && remaining_read_files > 0)
-				{
-					types_vec[positions[child].front()].append(output.substr(0, pos));
-					positions[child].pop();
-					output = output.substr(pos + 1);
-					remaining_read_files--;
-				}
-				if (!positions[child].empty())
-				{
-					types_vec[positions[child].front()] += output;
-				}
 			}
 		}
 	}
-
-	// Stats
-	if (gettimeofday(&end, NULL) != CODE_SUCCESS)
+	catch (const std::string& str)
 	{
+		close(inotify_fd);
+		setError(FUNC_WATCH, str);
 		return CODE_FAIL;
 	}
-	statFileNum += total_files;
-	statTime += calcTimeDiff(&begin, &end);
 
-	// Done!
+	close(inotify_fd);
+	if (root_gone && !stop)
+	{
+		setError(FUNC_WATCH, ERROR_ROOT_GONE);
+		return CODE_FAIL;
+	}
 	return CODE_SUCCESS;
 }
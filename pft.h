@@ -5,6 +5,8 @@ const int SUCCESS=0, FAILURE =-1;
 
 #include <vector>
 #include <string>
+#include <map>
+#include <stdint.h>
 
 
 typedef struct pft_stats_struct{
@@ -13,6 +15,71 @@ typedef struct pft_stats_struct{
 }pft_stats_struct;
 
 
+// How a command delimits the results it writes
+typedef enum pft_framing{
+	PFT_FRAME_NEWLINE, //every result ends with '\n'
+	PFT_FRAME_NUL,     //every result ends with '\0'
+	PFT_FRAME_LENGTH   //every result is preceded by its length, as a 4 byte unsigned in host byte order
+}pft_framing;
+
+
+typedef struct pft_cmd_struct{
+	std::string path;              //path of the executable
+	std::vector<std::string> argv; //its arguments, starting with the program name
+	char in_delim;                 //written after every input
+	pft_framing framing;           //how the results are delimited
+}pft_cmd_struct;
+
+
+typedef struct pft_timeouts_struct{
+	int file_ms;    //max time a child may work on a single file, 0 for no limit
+	int chunk_ms;   //max time a child may work on its whole chunk, 0 for no limit
+	bool speculate; //once there are no new files, duplicate the work of the slowest child onto idle ones
+}pft_timeouts_struct;
+
+typedef struct pft_delta_struct{
+	std::vector<std::string> changed; //paths created, modified or moved in
+	std::vector<std::string> types;   //the new 'file' result of each changed path, same index
+	std::vector<std::string> removed; //paths deleted or moved away
+}pft_delta_struct;
+
+// Called by pft_watch with every batch of changes. Returning non-zero stops watching.
+typedef int (*pft_watch_callback)(const pft_delta_struct& delta, void* arg);
+
+// Formats of the output files written by the *_to_file functions
+typedef enum pft_sink_format{
+	PFT_SINK_NDJSON, //a line {"index":i,"path":"...","result":"..."} per file, in completion order.
+	                 //Bytes that are not valid UTF-8 are written as \udcXX (surrogateescape)
+	PFT_SINK_BINARY, //PFT_BINARY_MAGIC, then a pft_record_header, path and result per file
+	PFT_SINK_INDEX   //PFT_INDEX_MAGIC, records as in binary, offsets table sorted by path, pft_index_footer
+}pft_sink_format;
+
+const char PFT_BINARY_MAGIC[8] = {'P', 'F', 'T', 'B', 'I', 'N', '1', '\0'};
+const char PFT_INDEX_MAGIC[8] = {'P', 'F', 'T', 'I', 'D', 'X', '1', '\0'};
+
+// Binary record, followed by path_len bytes of path and result_len bytes of result.
+// Records are packed one after the other, so they (and the table and footer) are not aligned -
+// copy them out with memcpy instead of casting a pointer into the file.
+typedef struct pft_record_header{
+	uint64_t index;      //index of the file in the input
+	uint32_t path_len;
+	uint32_t result_len;
+}pft_record_header;
+
+// End of an index file - the offsets table is count uint64_t record offsets, sorted by path
+typedef struct pft_index_footer{
+	uint64_t table_offset; //offset of the offsets table
+	uint64_t count;        //number of records
+	char magic[8];         //PFT_INDEX_MAGIC
+}pft_index_footer;
+
+// The result given to a file whose child exceeded a timeout while working on it
+const char* const PFT_TIMED_OUT = "pft: timed out";
+
+// The result given to the file a pft_worker was working on when it died
+const char* const PFT_WORKER_CRASHED = "pft: worker crashed";
+
+
 /*
 Initialize the pft library.
 Argument:
@@ -84,6 +151,78 @@ void pft_clear_stats();
 
 
 
+/*
+Set the timeouts and speculation policy used by pft_find_types and pft_run.
+A child exceeding a timeout is killed and replaced by a new one. The file it was working on gets
+PFT_TIMED_OUT as its result, and the rest of its chunk is sent again to the children.
+When speculating, the remaining work of the slowest child is duplicated onto an idle child in
+reverse order (so the file it is stuck on comes last). Both keep working and the first result of
+each file wins, so a file that is only slow gets its real result from whichever child answers it.
+Only the timeouts give a file up - speculation alone never reports PFT_TIMED_OUT. The child that
+lost keeps the files it was still working on when the call ends, and drops their results at the
+start of the next call, so it is not replaced just for being the second one.
+By default there are no timeouts and no speculation.
+
+A failure may happen if timeouts is null or if any of the timeouts is negative.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_set_timeouts error:" should be obtained by using the pft_get_error().
+*/
+int pft_set_timeouts(const pft_timeouts_struct* timeouts);
+
+
+
+/*
+Make pft_find_types (and pft_find_types_file, pft_watch) use the pft_worker executable at path,
+built next to libpft.a, instead of running 'file'. Each worker calculates types with libmagic and
+exchanges batches of names and results with the library through its own pair of shared-memory
+rings, so the pipes only carry one byte wakeups. Each worker is still a separate process, so a
+crash in libmagic only kills that worker: it is replaced, the file it was working on gets
+PFT_WORKER_CRASHED as its result and the rest of its chunk is sent again. A null path goes back to 'file'.
+Every new worker must write PFT_WORKER_HELLO into its channel when it starts, so if path is some
+other program (e.g /bin/cat) the next call fails instead of waiting for results that never come.
+Names and results larger than the rings are streamed through them.
+
+A failure may happen if path is not an executable.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_set_worker error:" should be obtained by using the pft_get_error().
+*/
+int pft_set_worker(const char* path);
+
+
+
+/*
+Start tracing the library - spawning children, dispatching chunks, select() wakeups, reads, parsing
+and results are recorded with timestamps into a buffer of "capacity" events. Once it is full the
+oldest events are overwritten. Recording costs a single branch while tracing is stopped, and
+nothing at all if the library is compiled with -DPFT_NO_TRACE. Compiling with -DPFT_USDT also
+fires a pft:event USDT probe per event.
+
+A failure may happen if capacity is not positive, if alloc fails or if tracing was compiled out.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_trace_start error:" should be obtained by using the pft_get_error().
+*/
+int pft_trace_start(int capacity);
+
+// Stop tracing, keeping the recorded events.
+// The function must not fail.
+void pft_trace_stop();
+
+/*
+Write the recorded events, in Chrome trace JSON format (chrome://tracing, Perfetto), to the file at path.
+Every child has its own lane, so idle children, slow reads and a saturated parent are easy to tell apart.
+
+A failure may happen if path is null or if the file can not be written.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_trace_dump error:" should be obtained by using the pft_get_error().
+*/
+int pft_trace_dump(const char* path);
+
+
+
 /*
 This function uses ‘file’ to calculate the type of each file in the given vector using n parallelism level.
 It gets a vector contains the name of the files to check (file_names_vec) and an empty vector (types_vec).
@@ -103,6 +242,122 @@ Return value:
 int pft_find_types(std::vector<std::string>& file_names_vec, std::vector<std::string>& types_vec);
 
 
+/*
+This function runs the command cmd on each input in the given vector using n parallelism level.
+Every input is written to the command's stdin followed by cmd.in_delim, and every result it writes
+back is cut according to cmd.framing and inserted to the same index in outputs.
+The command must answer its inputs in order, one result per input, and flush every result
+(as 'file -n' does). pft_find_types is pft_run with the 'file -n -f-' command.
+
+The function fails if cmd has no path or arguments, if cmd.path is not an executable or if a system call
+failed (for example fork failed).
+
+Parameters:
+	cmd - the command to run.
+	inputs - a vector contains the inputs to pass the command, e.g file names.
+	outputs - a vector that will be initialized with the results of cmd on each input.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_run error:" should be obtained by using the pft_get_error().
+*/
+int pft_run(const pft_cmd_struct& cmd, std::vector<std::string>& inputs, std::vector<std::string>& outputs);
+
+
+/*
+Same as pft_run, but the inputs are the records found in the len bytes at buf, each ended by delim
+(the last one may be unterminated). The chunks sent to the children are built straight from buf,
+so no string is allocated per input. buf must stay valid until the function returns.
+
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_run_buf error:" should be obtained by using the pft_get_error().
+*/
+int pft_run_buf(const pft_cmd_struct& cmd, const char* buf, size_t len, char delim,
+				std::vector<std::string>& outputs);
+
+/*
+Same as pft_run, but the inputs are the records of the file at list_path, each ended by delim.
+The file is mapped into memory (mmap) and the chunks are built straight from the mapped bytes,
+counting the records as they are dispatched instead of scanning the whole file first.
+
+The function also fails if the file can not be opened or mapped.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_run_file error:" should be obtained by using the pft_get_error().
+*/
+int pft_run_file(const pft_cmd_struct& cmd, const char* list_path, char delim,
+				 std::vector<std::string>& outputs);
+
+/*
+Same as pft_find_types, but the file names are the records of the file at list_path, each ended by
+delim - '\n' for a plain list, '\0' for the output of "find -print0". The list is mapped into memory
+and never copied name by name, so huge manifests need no vector of names.
+Note that 'file' reads its names line by line, so names must not contain a newline.
+
+The function also fails if the list can not be opened or mapped.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_find_types_file error:" should be obtained by using the pft_get_error().
+*/
+int pft_find_types_file(const char* list_path, char delim, std::vector<std::string>& types_vec);
+
+
+/*
+This function keeps a type index of the trees under roots current, re-classifying only what changed.
+It takes the index as a map from paths to their 'file' results (e.g from an earlier pft_find_types),
+subscribes (inotify) to create/modify/move/delete events under the roots and blocks, handling them:
+created, modified and moved-in files are classified again using the children, deleted and moved-away
+files are dropped. Events are batched until none arrived for debounce_ms, or until a batch is large
+enough to give every child a full chunk - but no change waits more than a few debounce_ms, even if
+events keep arriving. Every batch updates the index and is passed to callback as
+a delta, with arg. The function returns once callback returns non-zero.
+Paths in the index are the root followed by the relative path, e.g "root/dir/file".
+
+If the kernel drops events, the roots are walked again: their files are classified again, and indexed
+paths that are not there anymore are passed as removed. If a root itself is deleted or moved away,
+all its paths are passed as removed and the function fails, since nothing under it can be watched.
+
+The function fails if callback is null, debounce_ms is negative, a root is not a directory that can
+be watched, a root is deleted or moved while watching, or if a system call failed.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_watch error:" should be obtained by using the pft_get_error().
+*/
+int pft_watch(const std::vector<std::string>& roots, std::map<std::string, std::string>& index,
+			  int debounce_ms, pft_watch_callback callback, void* arg);
+
+
+/*
+Same as pft_run, pft_find_types and pft_find_types_file, but the results are not kept in a vector -
+they are written straight from the reading loop to the file at out_path, in the given format.
+Records are serialized into large batches that a background thread writes with pwrite, so memory
+stays bounded by a few batches regardless of the number of files (an index also keeps 8 bytes per
+file, to sort its offsets table by path once all the results were written).
+pft_find_types_file_to_file never holds all the names nor all the types in memory.
+
+The functions also fail if out_path is null or can not be written, or format is invalid.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with the function name and " error:" should be obtained by using the pft_get_error().
+*/
+int pft_run_to_file(const pft_cmd_struct& cmd, std::vector<std::string>& inputs,
+					const char* out_path, pft_sink_format format);
+int pft_find_types_to_file(std::vector<std::string>& file_names_vec, const char* out_path,
+						   pft_sink_format format);
+int pft_find_types_file_to_file(const char* list_path, char delim, const char* out_path,
+								pft_sink_format format);
+
+/*
+Find the result of path in an index file written in the PFT_SINK_INDEX format, in O(log n).
+
+The function fails if index_path is null, is not a valid index file or if path is not in it.
+Return value:
+	On success return SUCCESS, on error return FAILURE.
+	A valid error message, started with "pft_index_lookup error:" should be obtained by using the pft_get_error().
+*/
+int pft_index_lookup(const char* index_path, const std::string& path, std::string& result);
+
+
 #endif /* PFT_H */
 
 
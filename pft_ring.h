@@ -0,0 +1,115 @@
+#ifndef PFT_RING_H
+#define PFT_RING_H
+
+/*
+ * pft_ring.h
+ *
+ *	The shared-memory transport between the pft library and pft_worker.
+ *	Every worker shares a channel with the parent - two single-producer single-consumer
+ *	byte rings, one carrying file names to the worker and one carrying results back.
+ *	The pipes only carry one byte "doorbells", waking up the other side.
+ */
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+// Bytes of data in each ring, a power of 2
+const uint64_t PFT_RING_SIZE = 1 << 20;
+
+// File descriptor of the shared channel in the worker
+const int PFT_RING_FD = 3;
+
+// Doorbell byte written to a pipe to wake up the other side
+const char PFT_DOORBELL = '!';
+
+// Written by a worker into its channel at startup ("PFT" and the protocol version), before its
+// first doorbell - the parent checks it, so a program that is not a worker fails instead of hanging
+const uint32_t PFT_WORKER_HELLO = 0x50465401;
+
+
+typedef struct pft_ring{
+	alignas(64) std::atomic<uint64_t> head; //bytes written up to now, moved only by the producer
+	alignas(64) std::atomic<uint64_t> tail; //bytes read up to now, moved only by the consumer
+	alignas(64) char data[PFT_RING_SIZE];
+}pft_ring;
+
+
+typedef struct pft_channel{
+	pft_ring requests;               //parent -> worker, file names each ended by '\n'
+	pft_ring results;                //worker -> parent, results each preceded by a 4 byte length
+	std::atomic<int> worker_waiting; //the worker waits for the parent to free space in results
+	std::atomic<int> parent_waiting; //the parent has names waiting for space in requests
+	std::atomic<uint32_t> hello;     //PFT_WORKER_HELLO once the worker started
+}pft_channel;
+
+
+/*
+Write as many of the len bytes at buf to the ring as there is space for.
+Sets was_empty to whether the consumer had read everything before this write, i.e whether it may
+be waiting for a doorbell. Must only be called by the ring's producer.
+Return value:
+	The number of bytes written, 0 if the ring is full.
+*/
+inline uint64_t pft_ring_write_some(pft_ring* ring, const char* buf, uint64_t len, bool& was_empty)
+{
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	uint64_t tail = ring->tail.load();
+	if (PFT_RING_SIZE - (head - tail) < len)
+	{
+		len = PFT_RING_SIZE - (head - tail);
+	}
+	if (len == 0)
+	{
+		was_empty = false;
+		return 0;
+	}
+
+	uint64_t start = head % PFT_RING_SIZE;
+	uint64_t first = (len < PFT_RING_SIZE - start) ? len : PFT_RING_SIZE - start;
+	memcpy(ring->data + start, buf, first);
+	memcpy(ring->data, buf + first, len - first);
+	ring->head.store(head + len);
+
+	// Checked after publishing - the consumer checks head after moving tail, so one of us notices
+	was_empty = ring->tail.load() == head;
+	return len;
+}
+
+/*
+Write all the len bytes at buf to the ring, or nothing if there is not enough space.
+Sets was_empty as pft_ring_write_some. Must only be called by the ring's producer.
+Return value:
+	true if the bytes were written, false if there was not enough space.
+*/
+inline bool pft_ring_write(pft_ring* ring, const char* buf, uint64_t len, bool& was_empty)
+{
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (PFT_RING_SIZE - (head - ring->tail.load()) < len)
+	{
+		was_empty = false;
+		return false;
+	}
+	return pft_ring_write_some(ring, buf, len, was_empty) == len;
+}
+
+/*
+Read up to max bytes from the ring into buf. Must only be called by the ring's consumer.
+Return value:
+	The number of bytes read, 0 if the ring is empty.
+*/
+inline uint64_t pft_ring_read(pft_ring* ring, char* buf, uint64_t max)
+{
+	uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+	uint64_t head = ring->head.load();
+	uint64_t len = (head - tail < max) ? head - tail : max;
+
+	uint64_t start = tail % PFT_RING_SIZE;
+	uint64_t first = (len < PFT_RING_SIZE - start) ? len : PFT_RING_SIZE - start;
+	memcpy(buf, ring->data + start, first);
+	memcpy(buf + first, ring->data, len - first);
+	ring->tail.store(tail + len);
+	return len;
+}
+
+#endif /* PFT_RING_H */
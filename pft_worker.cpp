@@ -0,0 +1,214 @@
+/*
+ * pft_worker.cpp
+ *
+ *	The worker process of the pft library, a replacement for running 'file' itself.
+ *	It calculates file types with libmagic, and exchanges file names and results
+ *	with the parent through the shared-memory rings of pft_ring.h instead of pipes.
+ *	The parent keeps the process isolation - a crash in libmagic only kills this worker.
+ *
+ *	Usage: pft_worker, with the channel mapped at PFT_RING_FD, doorbells on stdin/stdout.
+ *	At startup it writes PFT_WORKER_HELLO into the channel and rings, which the parent checks.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <string>
+#include <magic.h>
+
+#include "pft_ring.h"
+
+// Return values
+static const int CODE_SUCCESS = 0;
+static const int CODE_FAIL = -1;
+
+// Delimiters
+static const char NEWLINE = '\n';
+static const std::string TYPE_SEPARATOR = ": ";
+
+// Bytes taken from the requests ring at once
+static const int READ_SIZE = 64 * 1024;
+
+
+/**
+ * Waits for a doorbell from the parent.
+ * Returns false if the parent is gone (or closed our stdin to stop us).
+ */
+bool waitForParent()
+{
+	char bells[PIPE_BUF];
+	return read(STDIN_FILENO, bells, PIPE_BUF) > 0;
+}
+
+/**
+ * Wakes up the parent.
+ */
+bool ringParent()
+{
+	return write(STDOUT_FILENO, &PFT_DOORBELL, 1) == 1;
+}
+
+/**
+ * Appends c to out as a backslash and three octal digits.
+ */
+void appendOctal(std::string& out, unsigned char c)
+{
+	out += '\\';
+	out += '0' + ((c >> 6) & 7);
+	out += '0' + ((c >> 3) & 7);
+	out += '0' + (c & 7);
+}
+
+/**
+ * Appends name to out the way 'file' prints file names (see fname_print in its file.c), so the
+ * results are the same: characters printable in the current locale are kept, other characters
+ * and bytes which are not a valid character are replaced by octal escapes, e.g "t\011ab".
+ */
+void appendPrintable(std::string& out, const std::string& name)
+{
+	const char* str = name.c_str();
+	size_t len = name.size();
+	mbstate_t state;
+	memset(&state, 0, sizeof(state));
+	while (len > 0)
+	{
+		wchar_t c;
+		size_t consumed = mbrtowc(&c, str, len, &state);
+		if (consumed == (size_t) -1 || consumed == (size_t) -2)
+		{
+			// Not a character - escape a byte and start over from the next one
+			memset(&state, 0, sizeof(state));
+			appendOctal(out, *str);
+			++str;
+			--len;
+			continue;
+		}
+		if (consumed == 0)
+		{
+			// A NUL byte, which 'file' could not be given
+			consumed = 1;
+		}
+		if (iswprint(c))
+		{
+			out.append(str, consumed);
+		}
+		else
+		{
+			// Like 'file', only the low byte of a wide character is escaped
+			appendOctal(out, c);
+		}
+		str += consumed;
+		len -= consumed;
+	}
+}
+
+/**
+ * Writes a result, preceded by its length, to the results ring. Whenever the ring is full,
+ * waits until the parent frees some space, so a result may be larger than the ring.
+ * The parent is woken up if it may be waiting for results.
+ * Returns false if the parent is gone.
+ */
+bool writeResult(pft_channel* channel, const std::string& result)
+{
+	std::string record(sizeof(uint32_t), '\0');
+	uint32_t len = result.size();
+	memcpy(&record[0], &len, sizeof(len));
+	record += result;
+
+	bool was_empty;
+	bool ring = false;
+	uint64_t written = 0;
+	while (written < record.size())
+	{
+		uint64_t now_written = pft_ring_write_some(&channel->results, record.data() + written,
+												   record.size() - written, was_empty);
+		if (now_written == 0)
+		{
+			// Full - tell the parent we wait, then check again in case it emptied it meanwhile
+			channel->worker_waiting.store(1);
+			now_written = pft_ring_write_some(&channel->results, record.data() + written,
+											  record.size() - written, was_empty);
+			if (now_written == 0 && (!ringParent() || !waitForParent()))
+			{
+				return false;
+			}
+			channel->worker_waiting.store(0);
+		}
+		written += now_written;
+		ring = ring || (now_written > 0 && was_empty);
+	}
+	return !ring || ringParent();
+}
+
+int main()
+{
+	// Names are printable or not according to the locale, as in 'file'
+	setlocale(LC_CTYPE, "");
+
+	magic_t magic = magic_open(MAGIC_NONE);
+	if (!magic || magic_load(magic, NULL) < 0)
+	{
+		return CODE_FAIL;
+	}
+
+	void* map = mmap(NULL, sizeof(pft_channel), PROT_READ | PROT_WRITE, MAP_SHARED, PFT_RING_FD, 0);
+	if (map == MAP_FAILED)
+	{
+		return CODE_FAIL;
+	}
+	close(PFT_RING_FD);
+	pft_channel* channel = (pft_channel*) map;
+
+	// Tell the parent it talks to a worker
+	channel->hello.store(PFT_WORKER_HELLO);
+	if (!ringParent())
+	{
+		return CODE_FAIL;
+	}
+
+	// File names not yet ended by a newline
+	std::string names;
+	char buf[READ_SIZE];
+	while (waitForParent())
+	{
+		uint64_t bytes_read;
+		while ((bytes_read = pft_ring_read(&channel->requests, buf, READ_SIZE)) > 0)
+		{
+			// Checked after moving tail - the parent sets it before trying again to write
+			if (channel->parent_waiting.load() && !ringParent())
+			{
+				return CODE_FAIL;
+			}
+			names.append(buf, bytes_read);
+			size_t pos = 0;
+			size_t end;
+			while ((end = names.find(NEWLINE, pos)) != std::string::npos)
+			{
+				std::string name = names.substr(pos, end - pos);
+				const char* type = magic_file(magic, name.c_str());
+				if (!type)
+				{
+					type = magic_error(magic);
+				}
+				std::string result;
+				appendPrintable(result, name);
+				result += TYPE_SEPARATOR;
+				result += type ? type : "";
+				if (!writeResult(channel, result))
+				{
+					return CODE_FAIL;
+				}
+				pos = end + 1;
+			}
+			names.erase(0, pos);
+		}
+	}
+
+	magic_close(magic);
+	munmap(map, sizeof(pft_channel));
+	return CODE_SUCCESS;
+}